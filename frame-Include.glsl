@@ -0,0 +1,11 @@
+//Per frame state, shared by all the programs. Must match FrameUniforms (std140) in
+//multiObjectTexture.cpp. Pulled into each shader with #include (see readShaderWithIncludes).
+layout(std140) uniform Frame{
+  mat4 view;
+  mat4 proj;
+  vec4 viewLightDir; //Already in view space
+  vec4 inColor;
+  float time;
+  ivec4 clusterGrid;  //Light clusters: tiles across, tiles up, depth slices, tile size in pixels
+  vec4 clusterDepth;  //Near and far plane, depth slices per unit of log(depth)
+};
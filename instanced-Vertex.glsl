@@ -0,0 +1,35 @@
+#version 150 core
+
+//Packed vertex (see PackedVertex): xyz are snorm16 in the mesh's bounds, and w is the model
+//index the asset worker stamps into each vertex, which picks the mesh's MeshDecode entry
+in ivec4 position;
+in vec2 inNormal;   //Octahedral encoded
+in vec2 inTexcoord; //0..1 over the mesh's texcoord range
+
+//Per-instance data, from the CPU transform stage (see runTransforms)
+in mat4 instMVP;
+in mat3x4 instModelView;    //Rows of the model-view matrix
+in mat3x4 instNormalMatrix; //Columns of the normal matrix (w unused)
+in int instTexID;
+
+out vec3 Color;
+out vec3 vertNormal;
+out vec3 pos;
+out vec3 lightDir;
+out vec2 texcoord;
+flat out int fragTexID;
+
+#include "frame-Include.glsl"
+
+#include "meshDecode-Include.glsl"
+
+void main() {
+   Color = inColor.rgb;
+   vec3 p = decodePosition(position);
+   gl_Position = instMVP * vec4(p,1.0);
+   pos = vec4(p,1.0) * instModelView;
+   lightDir = viewLightDir.xyz;
+   vertNormal = normalize((instNormalMatrix * octDecode(inNormal)).xyz);
+   texcoord = decodeTexcoord(position, inTexcoord);
+   fragTexID = instTexID;
+}
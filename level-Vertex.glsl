@@ -0,0 +1,26 @@
+#version 150 core
+
+//The static level mesh is already in world space, so there is no model matrix
+in vec3 position;
+in vec3 inNormal;
+in vec2 inTexcoord;
+in float inTexID;
+
+out vec3 Color;
+out vec3 vertNormal;
+out vec3 pos;
+out vec3 lightDir;
+out vec2 texcoord;
+flat out int fragTexID;
+
+#include "frame-Include.glsl"
+
+void main() {
+   Color = inColor.rgb;
+   gl_Position = proj * view * vec4(position,1.0);
+   pos = (view * vec4(position,1.0)).xyz;
+   lightDir = viewLightDir.xyz;
+   vertNormal = normalize(mat3(view) * inNormal); //The view matrix has no scale
+   texcoord = inTexcoord;
+   fragTexID = int(inTexID);
+}
@@ -0,0 +1,26 @@
+//Turning a PackedVertex back into floats, for the model program (instanced-Vertex.glsl). Must
+//match MeshDecodeUniforms (std140) and packVertices in multiObjectTexture.cpp.
+
+//Per model decode ranges, one entry per model (NUM_MODELS, which a static_assert keeps at 4)
+layout(std140) uniform MeshDecode{
+  vec4 meshCenter[4];
+  vec4 meshHalfExtent[4];
+  vec4 meshTexcoord[4];
+};
+
+//Inverse of octEncode
+vec3 octDecode(vec2 e){
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float fold = max(-n.z, 0.0);
+  n.x += n.x >= 0.0 ? -fold : fold;
+  n.y += n.y >= 0.0 ? -fold : fold;
+  return normalize(n);
+}
+
+vec3 decodePosition(ivec4 position){
+  return meshCenter[position.w].xyz + max(vec3(position.xyz) / 32767.0, -1.0) * meshHalfExtent[position.w].xyz;
+}
+
+vec2 decodeTexcoord(ivec4 position, vec2 texcoord){
+  return meshTexcoord[position.w].xy + texcoord * meshTexcoord[position.w].zw;
+}
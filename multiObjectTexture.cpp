@@ -18,11 +18,16 @@ const char* INSTRUCTIONS =
 "\n"
 "Up/down/left/right - Moves the knot.\n"
 "c - Changes to teapot to a random color.\n"
+"v - Toggles between the overhead and the first person view.\n"
+"p - Cycles frame pacing: vsync, adaptive vsync, uncapped.\n"
+"r - Starts/stops recording frames (see -record), s - Saves a screenshot.\n"
+"o - Shows the profiler overlay, t - Starts/stops writing a trace to trace.json.\n"
 "***************\n"
 ;
 
 //Mac OS build: g++ multiObjectTest.cpp -x c glad/glad.c -g -F/Library/Frameworks -framework SDL2 -framework OpenGL -o MultiObjTest
 //Linux build:  g++ multiObjectTest.cpp -x c glad/glad.c -g -lSDL2 -lSDL2main -lGL -ldl -I/usr/include/SDL2/ -o MultiObjTest
+//Headless benchmark (-benchmark, no window needed): add -DUSE_EGL -lEGL to the Linux build
 
 #include "glad/glad.h"  //Include order can matter here
 #if defined(__APPLE__) || defined(__linux__)
@@ -34,16 +39,45 @@ const char* INSTRUCTIONS =
 #endif
 #include <cstdio>
 #include <GL/glut.h>
+#ifdef USE_EGL
+ #include <EGL/egl.h>
+ #include <EGL/eglext.h>
+#endif
 #define GLM_FORCE_RADIANS
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 #include "glm/gtc/type_ptr.hpp"
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+ #include <xmmintrin.h>
+ #define TRANSFORM_SSE
+#endif
 
 #include <cstdio>
+#include <cstring>
+#include <cstddef>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#if defined(__APPLE__) || defined(__linux__)
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+#else
+ #include <sys/stat.h>
+#endif
+#if defined(__linux__)
+ #include <sys/inotify.h>
+#endif
 using namespace std;
 
 // Shader sources
@@ -79,31 +113,509 @@ const GLchar* fragmentSource =
 int screenWidth = 1000;
 int screenHeight = 800;
 float timePast = 0;
-float time_per_frame = 0.5;
-int whichKey = 0;
-struct key{
-  glm::vec3 position;
-} ;
+
+//The game simulates in fixed ticks, sampling the keyboard each tick, and every frame draws
+//the state interpolated between the last two ticks. timePast is simulation time.
+const double TICK_SECONDS = 1/120.0;
+const int MAX_TICKS_PER_FRAME = 8; //After a long stall we drop time rather than try to catch up
+enum { PACE_VSYNC, PACE_ADAPTIVE, PACE_UNCAPPED };
+const char* pacingNames[] = {"vsync", "adaptive vsync", "uncapped"};
+int framePacing = PACE_VSYNC;
+bool waitForPresent = true; //glFinish after the swap, so the CPU can't queue frames ahead of the display
+void setFramePacing(int pacing);
 
 //SJG: Store the object coordinates
-//You should have a representation for the state of each object
-float objx=0, objy=0, objz=0;
+//You should have a representation for the state of each object (see EntityStore)
 float colR=1, colG=1, colB=1;
 float velocity = 2.0f;
-//You should have a representation for the state of each object
-float objWx=0, objWy=0, objWz=0;
-float doory,doorz = 0;
-glm::vec3 wallPositions[9];
-bool collideKey = false;
-bool collideWall = false;
-bool collideDoor = false;
-
+float simAlpha = 0; //How far drawing is between the last tick and the next
+void simTick(const Uint8* keys);
+void interpolateSim(float alpha);
+
+//Entities: the player, the keys, the doors, the agents and the torches (anything that moves, lights up or can be walked into),
+//stored as parallel arrays of components indexed by entity. Each system reads only the arrays
+//it needs, front to back. Entities are made when the level loads and never deleted, a key that
+//has been picked up or a door that has been opened just stops being active.
+enum { ENTITY_PLAYER, ENTITY_KEY, ENTITY_DOOR, ENTITY_AGENT, ENTITY_TORCH };
+enum { COLLIDER_NONE, COLLIDER_SOLID, COLLIDER_TRIGGER };
+struct EntityStore{
+  vector<unsigned char> kind, active;
+  //Transform: (column, row) in the map plane and height above the walking level, now and as
+  //of the last tick (things are drawn in between)
+  vector<float> col, row, height;
+  vector<float> prevCol, prevRow, prevHeight;
+  vector<float> moveCol, moveRow;  //Wanted movement this tick, applied (and cleared) by moveEntities
+  //Render
+  vector<unsigned char> model;
+  vector<signed char> texID;
+  vector<float> scale, spin;
+  vector<unsigned char> lod;           //Level of detail it was drawn at last frame
+  //Light: a point light over the entity, radius 0 for none
+  vector<glm::vec3> lightColor;
+  vector<float> lightRadius;
+  //Collider: a square footprint
+  vector<unsigned char> collider;
+  vector<float> half;
+  //Key/door link: the code of a key, the code of the key a door needs, and for the player the
+  //codes it holds (a bit per code)
+  vector<unsigned char> keyCode;
+  vector<unsigned int> keysHeld;
+  vector<unsigned char> navField;      //Flow field an agent follows (NAV_*)
+  unordered_map<long long,int> doorAt; //Cell (row*width + col) -> its door, for collision and the PVS
+  int player;                          //-1 when the level has no spawn
+  EntityStore() : player(-1) {}
+  int count() const { return kind.size(); }
+};
+EntityStore entities;
+struct Level;
+int addEntity(EntityStore& es, int kind, glm::vec2 cell, int model, int texID, float scale, float spin,
+              int collider, float half, int keyCode);
+void spawnEntities(EntityStore& es, const Level& level);
+void moveEntities(EntityStore& es);
+void triggerEntities(EntityStore& es);
+void drawEntities(EntityStore& es);
+glm::vec3 entityDrawPosition(const EntityStore& es, int e);
+int agentCount = 0;       //Agents spawned with each level (-agents)
+float agentSpeed = 1.5f;  //Cells per second
+
+//Navigation: agents follow flow fields over the level grid rather than each searching for a
+//path. A field has, for every cell, the number of steps to the nearest of its goals and which
+//neighbour to step to next, so moving an agent is one lookup in the cell it is in. Fields are
+//rebuilt on background threads when their goals move, and patched in place when a door opens.
+//The chase field moves with the player every few ticks, so it only reaches NAV_CHASE_RANGE
+//steps: a rebuild costs the cells near the player, not the whole level. Chasers out of range
+//follow the objectives field instead.
+enum { NAV_CHASE, NAV_OBJECTIVES, NUM_NAV_FIELDS }; //Toward the player, toward the nearest key or closed door
+enum { NAV_NONE, NAV_EAST, NAV_WEST, NAV_NORTH, NAV_SOUTH }; //+col, -col, +row, -row
+const unsigned int NAV_UNREACHED = 0xFFFFFFFF;
+const unsigned int NAV_CHASE_RANGE = 64; //Steps from the player
+struct NavGrid{
+  int width, height;
+  vector<unsigned char> open; //1 where agents can walk, row*width + col
+};
+struct FlowField{
+  vector<glm::ivec2> goals;   //(col, row) it was built for
+  vector<unsigned int> dist;  //Steps to the nearest goal, NAV_UNREACHED if there is no way there
+  vector<unsigned char> dir;  //NAV_* step toward it
+  unsigned int range;         //Cells farther than this from every goal are left unreached
+  vector<int> reached;        //With a range, every cell that was reached (what a rebuild has to clear)
+  FlowField() : range(NAV_UNREACHED) {}
+};
+struct Navigation{
+  NavGrid grid;
+  FlowField fields[NUM_NAV_FIELDS];   //What the agents follow
+  FlowField building[NUM_NAV_FIELDS]; //Being rebuilt by the builder thread, swapped in when done
+  bool rebuilding[NUM_NAV_FIELDS];
+  vector<int> agents[NUM_NAV_FIELDS];  //Agents following each field, kept from the spawn
+  vector<int> objectives;             //Keys and doors, the goals of NAV_OBJECTIVES while active
+  vector<int> openedDoors;            //Door cells opened since the grid was last patched
+  thread builder;
+  bool busy;                          //The builder owns grid and building[] until it is finished
+  std::atomic<bool> finished;
+  int numThreads;
+  int builds, doorUpdates;
+  double lastBuildMs;
+};
+Navigation nav;
+void resetNavigation(Navigation& nav, const Level& level, const EntityStore& es);
+void updateNavigation(Navigation& nav, const EntityStore& es);
+void stopNavigation(Navigation& nav);
+void buildFlowFields(const NavGrid& grid, FlowField* fields, int count, int numThreads);
+void navDoorOpened(Navigation& nav, int row, int col);
+int openNavCells(Navigation& nav);
+void steerAgents(EntityStore& es, const Navigation& nav);
+bool benchmarkNavigation(const char* mapFile, int agents);
+
+//Collision is done in the map plane, in (column, row) like the cells, which are unit squares
+//centered on whole numbers. The level grid is the static geometry: boxes are swept against it
+//cell by cell, so they can't tunnel however far they move in a tick, and slide along walls.
+//Moving things (and trigger volumes like the key and the door) go in a spatial hash that is
+//rebuilt every tick, so finding what overlaps a box only looks at the few boxes near it.
+struct Box2{
+  glm::vec2 center, half;
+};
+const float PLAYER_HALF = .25f;   //The knot's footprint, half a side
+const float COLLISION_SKIN = 1e-3f; //Gap left between a box and the wall that stopped it
+struct SpatialHash{
+  float cellSize;
+  unsigned int mask;        //Buckets-1, the bucket count is a power of two
+  vector<int> bucketStart;  //Bucket b holds entries[bucketStart[b] .. bucketStart[b+1])
+  vector<int> entries;      //Indices into boxes
+  vector<Box2> boxes;
+};
+struct CollisionWorld{
+  SpatialHash triggerHash;   //Trigger colliders (keys and doors), rebuilt with the entities
+  vector<int> triggerEntity; //Entity of each box in triggerHash
+};
+CollisionWorld collision;
+bool cellSolid(const Level& level, const EntityStore& es, int row, int col);
+glm::vec2 moveAndSlide(const Box2& box, glm::vec2 delta, bool* blocked = NULL);
+void buildSpatialHash(SpatialHash& hash, float cellSize);
+void querySpatialHash(const SpatialHash& hash, const Box2& box, vector<int>& found);
+void buildTriggers(CollisionWorld& world, const EntityStore& es);
+
+
+//Binary mesh cache. Each models/*.txt is compiled into a *.mesh file holding this header
+//followed by numVerts PackedVertex and then numIndices triangle indices. The cache is rebuilt
+//whenever the .txt is newer. When building it, duplicate vertices are welded into an index
+//buffer and triangles are reordered for the post-transform vertex cache (see optimizeVertexCache).
+//Simplified levels of detail (see simplifyMesh) follow the full mesh in the index list, all
+//drawn from the same vertices.
+enum { ATTRIB_POSITION, ATTRIB_TEXCOORD, ATTRIB_NORMAL, NUM_ATTRIBS };
+const int MESH_CACHE_VERSION = 4;
+//Model vertices are quantized to 16 bytes (the text files have 8 floats, 32 bytes):
+// - position: snorm16 within the mesh's bounding box. w holds the mesh's entry in the
+//   MeshDecode uniform block, which the loader fills in when it stages the vertices.
+// - normal: octahedral encoded, snorm16 x2
+// - texcoord: unorm16 within the mesh's texcoord range (they go past 1 on the teapot)
+struct PackedVertex{
+  short position[4];
+  short normal[2];
+  unsigned short texcoord[2];
+};
+const int MAX_MESH_LODS = 4;
+struct MeshLod{
+  int firstIndex, numIndices; //Relative to the mesh's first index
+  float error;                //How far (in model units) this level strays from the full mesh
+};
+struct MeshCacheHeader{
+  char magic[4];          //"MSHC"
+  int version;            //MESH_CACHE_VERSION
+  int numVerts;           //Unique (welded) vertices
+  int vertexBytes;        //sizeof(PackedVertex)
+  int numAttribs;
+  struct { int offset, components, type, normalized; } attribs[NUM_ATTRIBS]; //Offsets in bytes, GL types
+  int numIndices;         //Triangle list indices (relative to this mesh) of every LOD, stored after the vertices
+  int numLods;
+  MeshLod lods[MAX_MESH_LODS]; //lods[0] is the full mesh
+  float radius;           //Bounding sphere around the model's origin
+  float center[3], halfExtent[3]; //Position decode: center + position*halfExtent
+  float texcoordMin[2], texcoordExtent[2];
+  int numSourceVerts;     //Vertex count of the original triangle soup
+  float textParseMs;      //How long the text parse took when the cache was built (for reporting)
+};
+struct MappedMesh{
+  const MeshCacheHeader* header;
+  const PackedVertex* verts; //Points into the mapping, right after the header
+  const unsigned int* indices; //Points into the mapping, right after the vertices
+  void* mapBase;
+  size_t mapLength;
+};
+enum { MODEL_TEAPOT, MODEL_KNOT, MODEL_CUBE, MODEL_SPHERE, NUM_MODELS };
+const char* modelFiles[NUM_MODELS] = {"models/teapot.txt", "models/knot.txt", "models/cube.txt", "models/sphere.txt"};
+bool loadMeshCache(const char* txtFileName, MappedMesh& mesh);
+void unmapMeshCache(MappedMesh& mesh);
+double elapsedMs(Uint64 start);
+bool mapFile(const char* fileName, size_t minLength, void*& base, size_t& length);
+void unmapFile(void* base, size_t length);
+
+//Where each model lives in the shared VBO/EBO. firstIndex/numIndices are the full mesh and
+//lods[l].firstIndex is in the whole EBO.
+struct MeshRange{
+  int baseVertex, numVerts;
+  int firstIndex, numIndices;
+  int numLods;
+  MeshLod lods[MAX_MESH_LODS];
+  float radius;
+};
+MeshRange modelRanges[NUM_MODELS];
+const float LOD_PIXEL_ERROR = 1;    //Largest simplification error a prop may show, in pixels
+const float LOD_HYSTERESIS = .75f;  //Go coarser only when the next level is this far under it
+
+//A linked program plus its active uniforms and attributes, looked up once at link time so
+//drawing never has to ask the driver for a location by name
+struct ShaderProgram{
+  GLuint id;
+  unordered_map<string,GLint> uniforms, attribs;
+  GLint uniform(const char* name) const; //-1 if the program doesn't use it
+  GLint attrib(const char* name) const;
+};
+bool loadShaderProgram(ShaderProgram& program, const char* vShaderFileName, const char* fShaderFileName);
+void setModelAttribs(const ShaderProgram& shader, const MeshCacheHeader* layout);
+
+//Camera, lighting and time for the frame. Every program reads these from the same uniform
+//buffer (the Frame block in frame-Include.glsl), which is filled once per frame.
+struct FrameUniforms{ //std140 layout
+  glm::mat4 view;
+  glm::mat4 proj;
+  glm::vec4 viewLightDir; //Light direction in view space (w unused)
+  glm::vec4 inColor;      //Color of untextured models (w unused)
+  float time;
+  float pad[3];
+  int clusterGrid[4];     //Light clusters (see binLights): tiles across, tiles up, depth slices, tile size in pixels
+  float clusterDepth[4];  //Near and far plane, depth slices per unit of log(depth) (w unused)
+};
+const GLuint FRAME_UBO_BINDING = 0;
+GLuint frameUbo;
+FrameUniforms frameUniforms; //What was last uploaded, for the CPU side of the frame
+void updateFrameUniforms(const glm::mat4& view, const glm::mat4& proj);
+float projectionNear(const glm::mat4& proj);
+float projectionFar(const glm::mat4& proj);
+
+//How the model programs turn a PackedVertex back into floats, one entry per model. Filled in
+//once the models are loaded.
+struct MeshDecodeUniforms{ //std140 layout
+  glm::vec4 center[NUM_MODELS];     //Position = center + position*halfExtent (w unused)
+  glm::vec4 halfExtent[NUM_MODELS];
+  glm::vec4 texcoord[NUM_MODELS];   //Texcoord = xy + texcoord*zw
+};
+static_assert(NUM_MODELS == 4, "meshDecode-Include.glsl sizes the MeshDecode arrays [4]");
+const GLuint MESH_DECODE_UBO_BINDING = 1;
+GLuint meshDecodeUbo;
+MeshDecodeUniforms meshDecode;
+
+//CPU transform stage. Objects are queued into structure-of-arrays inputs with addTransform,
+//then runTransforms builds every model matrix (translate * rotate * scale), combines it with
+//the frame's view and projection, and writes out what the vertex shaders need, four objects
+//at a time with SSE. The shaders then do no matrix work beyond one multiply per vertex.
+struct ObjectTransform{
+  glm::mat4 mvp;
+  glm::vec4 modelView[3];    //Rows of the (affine) model-view matrix
+  glm::vec4 normalMatrix[3]; //Columns of the model-view cofactor matrix, w unused
+};
+struct TransformBatch{
+  vector<float> px, py, pz;     //Translation
+  vector<float> sx, sy, sz;     //Scale (applied first)
+  vector<float> qx, qy, qz, qw; //Rotation as a unit quaternion
+  vector<ObjectTransform> out;  //Filled by runTransforms, same order as added
+};
+glm::vec4 axisAngle(glm::vec3 axis, float angle);
+glm::vec4 quatMul(const glm::vec4& a, const glm::vec4& b);
+void clearTransforms(TransformBatch& batch);
+int addTransform(TransformBatch& batch, glm::vec3 position, glm::vec3 scale, glm::vec4 rotation);
+void runTransforms(TransformBatch& batch, const glm::mat4& view, const glm::mat4& proj);
+
+//Props (keys, the player, agents) are picked out by the scene traversal (see drawEntities) and
+//drawn instanced, one draw call per model. Their matrices come from the transform stage (see runTransforms).
+GLuint propVao, propInstanceVbo;
+struct PropGPU{   //What queueProps uploads per instance
+  ObjectTransform transform;
+  GLint texID;
+  GLint pad[3];
+};
+GLint propMvpAttrib, propModelViewAttrib, propNormalAttrib, propTexAttrib;
 
 bool DEBUG_ON = true;
 GLuint InitShader(const char* vShaderFileName, const char* fShaderFileName);
+
+//Every texture is one layer of a single GL_TEXTURE_2D_ARRAY, so any draw can use any of them
+//and a texID just picks the layer (-1 = untextured, use inColor)
+const char* materialFiles[] = {"wood.bmp", "brick.bmp", "plate.bmp", "PoolWater.bmp"};
+const int NUM_MATERIALS = sizeof(materialFiles)/sizeof(materialFiles[0]);
+const int MATERIAL_SIZE = 512; //The layers all have to be the same size, so images are rescaled to this
+const int MATERIAL_UNIT = 0;   //Texture unit the array is bound to
+GLuint createMaterialArray(int count);
+
+//Cooked textures. Each BMP is converted once into a *.tex file holding this header and then
+//every mip level (MATERIAL_SIZE down to 1x1, largest first) already in the format we upload,
+//so startup only maps the file and hands the levels to GL. A texture is cooked again whenever
+//its .bmp is newer or the wanted format changed. -cooktextures cooks them all and exits.
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+enum { TEXTURE_BGRA8, TEXTURE_BC1 }; //BC1 (DXT1) is 8 bytes per 4x4 block, 1/8th of BGRA8
+const int TEXTURE_CACHE_VERSION = 1;
+struct TextureCacheHeader{
+  char magic[4];          //"TEXC"
+  int version;            //TEXTURE_CACHE_VERSION
+  int format;             //TEXTURE_BGRA8 or TEXTURE_BC1
+  int size;               //Width and height of mip level 0
+  int numLevels;
+  int sourceWidth, sourceHeight; //Size of the BMP before it was rescaled
+  float cookMs;           //How long cooking took (for reporting)
+};
+bool compressTextures = false; //-compresstextures: cook and upload BC1 when the driver supports it
+bool cookTexture(const char* bmpFileName, int format);
+
+//Asynchronous asset loading. Worker threads load (and if needed build) the mesh caches and
+//cooked textures while the GL thread is already drawing. Each frame pumpAssets() moves the
+//finished work along on the GL thread:
+//  ASSET_LOADING  worker: loadMeshCache / mapTextureCache
+//  ASSET_LOADED   GL thread: create a staging buffer (a PBO for textures) and map it
+//  ASSET_STAGING  worker: copy the mapped file into the staging buffer
+//  ASSET_STAGED   GL thread: unmap it and upload from it (textures), or once every model is
+//                 staged, copy them all into the shared model buffers (see uploadModels)
+//Until then the texture array shows a flat placeholder and props are left out.
+enum { ASSET_MODEL, ASSET_TEXTURE };
+enum AssetState { ASSET_LOADING, ASSET_LOADED, ASSET_STAGING, ASSET_STAGED, ASSET_DONE, ASSET_FAILED };
+struct AssetJob{
+  int kind;               //ASSET_MODEL or ASSET_TEXTURE
+  int index;              //Into modelFiles or materialFiles
+  AssetState state;       //Only changed while holding AssetLoader::lock
+  MappedMesh mesh;        //Models
+  void* mapBase;          //Textures, the mapped *.tex file
+  size_t mapLength;
+  GLuint staging;         //Buffer object the data is copied into
+  void* stagingPtr;       //Its mapping, written by a worker
+  size_t stagingBytes;
+};
+struct AssetLoader{
+  vector<AssetJob> jobs;  //Fixed once the workers start
+  vector<thread> workers;
+  mutex lock;
+  condition_variable wake;
+  deque<int> queue;       //Jobs that have work for a worker (loading or staging)
+  bool quit;
+  int numDone, modelsStaged;
+  GLuint modelVbo, modelEbo;
+  GLuint modelVao;        //VAO drawing from the model buffers, with the program it is set up for
+  const ShaderProgram* modelShader;
+  GLuint materialTex;
+  Uint64 start;
+};
+AssetLoader assets;
+void startAssetLoading(AssetLoader& loader);
+bool pumpAssets(AssetLoader& loader);
+void stopAssetLoading(AssetLoader& loader);
 bool fullscreen = false;
+
+//Frame capture: each frame is read back into the next pixel buffer object of a ring without
+//waiting, and mapped a few frames later once its fence says the copy is done. The pixels then
+//go to a writer thread, which saves PPM files or pipes raw frames to an encoder.
+const int CAPTURE_RING = 3;
+const int CAPTURE_MAX_QUEUED = 16; //Frames waiting for the writer before we start dropping them
+struct CapturedFrame{
+  vector<unsigned char> rgba; //Bottom row first, as GL reads it
+  int number;                 //In the recording, -1 if not recorded
+  int screenshot;             //Screenshot number, -1 if it isn't one
+};
+struct FrameCapture{
+  int width, height;
+  GLuint pbos[CAPTURE_RING];
+  GLsync fences[CAPTURE_RING]; //0 when the slot is free
+  bool slotRecorded[CAPTURE_RING], slotScreenshot[CAPTURE_RING];
+  int next;                    //Slot the next frame is read into
+  bool recording, screenshotPending;
+  int frames, screenshots, dropped;
+  const char* prefix;          //Recordings are saved as <prefix>00000.ppm, ...
+  const char* pipeCommand;     //...or piped as raw RGB frames to this (e.g. ffmpeg), if set
+  FILE* pipe;
+  thread writer;
+  mutex lock;
+  condition_variable wake;
+  deque<CapturedFrame> queue;
+  vector<vector<unsigned char> > spare; //Buffers the writer is done with
+  bool quit;
+  double readbackMs;                    //Time spent in captureFrame
+  int readbacks;
+};
+FrameCapture capture;
+void startCapture(FrameCapture& cap, int width, int height);
+void captureFrame(FrameCapture& cap);
+void stopCapture(FrameCapture& cap);
 void Win2PPM(int width, int height);
 
+//Headless benchmark: -benchmark <frames> renders offscreen (EGL, no window or display needed),
+//flies a scripted camera over the map and reports frame times and what was drawn as JSON
+struct RenderStats{
+  long long drawCalls, triangles; //Submitted since the last reset
+  long long vertices;             //Indices drawn, so vertex shader runs before the post-transform cache
+  long long stateChanges;         //Binds that reached GL
+  long long stateRequests;        //Binds asked for, before the state cache filtered them
+  long long lights, lightEntries; //Lights binned, and the cluster list entries they made
+};
+RenderStats renderStats;
+int benchmarkFrames = 0;
+const char* benchmarkJson = NULL; //Also write the report here
+bool createHeadlessContext(GLADloadproc* loader);
+void destroyHeadlessContext();
+GLuint createOffscreenTarget(int width, int height, GLuint buffers[2]);
+void benchmarkCamera(int frame, int frames, glm::mat4& view, glm::mat4& proj);
+void reportBenchmark(const char* mapFile, vector<double>& frameMs, const vector<RenderStats>& frameStats);
+
+//Render queue: a frame's draws are recorded as commands with a 64 bit key (program, texture,
+//mesh, depth) and radix sorted, so draws that share state are submitted together. Submission
+//goes through a cache of the GL state that skips binds that would change
+//nothing. Anything else that binds programs or VAOs has to go through it too, or forget it.
+enum { DRAW_MULTI, DRAW_INSTANCED };
+struct RenderCommand{
+  GLuint program, vao, texture;
+  int kind;
+  GLsizei count;      //Indices (DRAW_MULTI: index ranges, in the queue's multiCounts/multiOffsets)
+  int first;          //First index in the EBO (DRAW_MULTI: first range)
+  GLint baseVertex;
+  GLsizei instances;
+  size_t instanceBase; //DRAW_INSTANCED: byte offset of the draw's instances in propInstanceVbo
+};
+struct RenderSortItem{
+  unsigned long long key;
+  unsigned int index; //Into commands
+};
+struct RenderQueue{
+  vector<RenderCommand> commands;
+  vector<RenderSortItem> items, scratch;
+  vector<GLsizei> multiCounts;
+  vector<const void*> multiOffsets;
+};
+const GLuint GL_STATE_UNKNOWN = 0xFFFFFFFF;
+struct GLStateCache{
+  GLuint program, vao, texture; //GL_STATE_UNKNOWN after something else may have changed them
+  size_t propInstanceBase;      //Where propVao's instance attributes point
+  GLStateCache() : program(GL_STATE_UNKNOWN), vao(GL_STATE_UNKNOWN), texture(GL_STATE_UNKNOWN), propInstanceBase((size_t)-1) {}
+};
+RenderQueue renderQueue;
+GLStateCache glState;
+unsigned long long renderKey(GLuint program, GLuint texture, int mesh, float depth);
+void queueDraw(RenderQueue& queue, unsigned long long key, const RenderCommand& command);
+void sortRenderQueue(RenderQueue& queue);
+void submitRenderQueue(RenderQueue& queue, GLStateCache& cache);
+void queueProps(const MeshRange* models, GLuint program, GLuint texture, float farPlane, RenderQueue& queue);
+void forgetGLState(GLStateCache& cache);
+void bindProgram(GLStateCache& cache, GLuint program);
+void bindVertexArray(GLStateCache& cache, GLuint vao);
+void bindMaterials(GLStateCache& cache, GLuint texture);
+void bindPropInstances(GLStateCache& cache, size_t base);
+
+//Profiler: ProfileScope times the block it is declared in (and optionally the GL commands issued
+//in it, with timestamp queries that are read back PROFILE_LAG frames later so we never wait on
+//the GPU). Finished frames can be shown as bars over the scene and written as a trace for
+//chrome://tracing or Perfetto.
+const int PROFILE_LAG = 4;
+const int PROFILE_HISTORY = 120; //Frames shown in the overlay's graph
+struct ProfileZone{
+  const char* name;
+  double startMs, endMs; //Since the profiler started. GPU zones are moved onto the CPU clock.
+  int depth;
+  bool gpu;
+  GLuint queries[2];     //GPU zones: timestamps at the start and the end
+};
+struct ProfileFrame{
+  long long number;
+  vector<ProfileZone> zones;
+  RenderStats stats;
+};
+struct Profiler{
+  Uint64 origin;
+  double gpuOffsetMs;      //Add to a GPU timestamp (in ms) to get our time
+  int depth, gpuDepth;
+  long long frameNumber;   //Of the frame being recorded
+  ProfileFrame frames[PROFILE_LAG];
+  vector<GLuint> spareQueries;
+  ProfileFrame last;       //Newest frame with all its GPU times, what the overlay shows
+  float cpuHistory[PROFILE_HISTORY], gpuHistory[PROFILE_HISTORY];
+  bool overlay;
+  ShaderProgram overlayShader;
+  GLuint overlayVao, overlayVbo;
+  Uint32 lastTitle;
+  FILE* trace;
+  const char* traceFile;
+  int traceFrames;         //Left to write, 0 for no limit
+};
+Profiler profiler;
+struct ProfileScope{
+  ProfileScope(const char* name, bool gpu = false);
+  ~ProfileScope(){ end(); }
+  void end();
+  ProfileFrame* frame;
+  int cpuZone, gpuZone;
+};
+void startProfiler(Profiler& prof);
+void profileBeginFrame(Profiler& prof);
+void drawProfilerOverlay(Profiler& prof, SDL_Window* window);
+bool startTrace(Profiler& prof, const char* fileName, int frames);
+void stopTrace(Profiler& prof);
+void stopProfiler(Profiler& prof);
+
 //srand(time(NULL));
 float rand01(){
 	return rand()/(float)RAND_MAX;
@@ -123,33 +635,304 @@ float CameraUpY = 0.0;
 float CameraUpZ = 0.0;
 float CameraAngle = atan2(CameraDirY,CameraDirX);
 
-float keyx,keyy,keyz;
-
-int map[5][5];
-void drawGeometry(int shaderProgram, int model1_start, int model1_numVerts, int model2_start, int model2_numVerts,int square_start, int square_numVerts,int sphere_start, int sphere_numVerts);
+//The level is compiled from the text map into a chunked binary file (map2.txt -> map2.chunks)
+//which is mmap'd. Cells are read straight from the mapping (see levelFileCell), so the OS only
+//pages in the parts of the file that get touched. Only the chunks near the player are resident,
+//with their meshes and PVSes, so mazes can have millions of cells. The compiled file is rebuilt whenever the text map is newer.
+//Cell codes: 0 = floor, 1 = unused, 2 = wall, 3 = door, 4 = player spawn, 5/6 = keys.
+enum { CELL_FLOOR = 0, CELL_WALL = 2, CELL_DOOR = 3, CELL_SPAWN = 4, CELL_KEY_PLATE = 5, CELL_KEY_WATER = 6 };
+const int CHUNK_SIZE = 16;                        //Chunks are CHUNK_SIZE x CHUNK_SIZE cells
+const int CHUNK_BYTES = CHUNK_SIZE*CHUNK_SIZE/2;  //4 bits per cell
+const int CHUNK_STREAM_RADIUS = 2;                //Chunks within this many chunks of the player are resident
+const int CHUNK_BUDGET = 36;                      //Max resident chunks, at least (2*radius+1)^2
+const int LEVEL_CACHE_VERSION = 1;
+struct LevelFileHeader{
+  char magic[4];          //"MAPC"
+  int version;            //LEVEL_CACHE_VERSION
+  int width, height;      //Columns and rows
+  int chunkSize, chunksX, chunksY;
+  int spawnCol, spawnRow, hasSpawn;
+  int keyCol, keyRow, keyCode;    //The key the player is after (keyCode 0 if there is none)
+  int doorCol, doorRow, hasDoor;  //The door that key opens
+  int numWalls, numDoors, numKeys;
+};
+//Vertex of the static level mesh. Unlike the models, every face carries its texture id.
+struct LevelVertex{
+  float position[3];
+  float texcoord[2];
+  float normal[3];
+  float texID;
+};
+//Potentially visible sets. The open map cells are the PVS cells and the open edges between
+//them the portals. A cell's PVS is every cell within PVS_RADIUS that a ray from somewhere in
+//the cell can reach without passing through a wall (or a closed door); walls that stop a ray
+//are in the set too. PVSes are computed the first time the player stands in a cell and cached
+//with the chunk. Opening a door only throws away the PVSes that had a ray reach that door.
+const int PVS_RADIUS = 12;   //A bit past the far plane
+const int PVS_SPAN = 2*PVS_RADIUS+1;
+const int PVS_RAYS = 256;    //Rays cast from each sample point in the cell
+struct CellPVS{
+  unsigned int bits[(PVS_SPAN*PVS_SPAN+31)/32]; //Window of cells centered on the PVS cell
+};
+//Chunk data follows the header, chunk (cx,cy) at offset (cy*chunksX + cx)*CHUNK_BYTES, its
+//cells row major within the chunk, two cells per byte
+struct MapChunk{
+  int cx, cy;
+  vector<LevelVertex> mesh;               //Greedy meshed floor and walls, 4 vertices per quad
+  int firstQuad;                          //Where the mesh starts in the level vertex buffer
+  bool visible;                           //Bounding box touches the view frustum this frame
+  vector<CellPVS> pvs;                    //Per cell PVS, filled in on demand (see levelPVS)
+  vector<bool> pvsDone;
+};
+struct Level{
+  int width, height;          //Columns and rows
+  int chunksX, chunksY;
+  glm::ivec2 spawn;           //(col, row) the player starts in
+  bool hasSpawn;
+  const LevelFileHeader* header;
+  const unsigned char* chunkData; //Points into the mapping (or parseLevel's image), right after the header
+  void* mapBase;
+  size_t mapLength;
+  vector<MapChunk> chunks;        //Resident chunks, never more than CHUNK_BUDGET
+  unordered_map<int,int> slotOf;  //Chunk index (cy*chunksX + cx) -> position in chunks
+  glm::ivec2 streamCenter;        //Chunk the resident set was last built around
+  int pageIns, pageOuts;
+  bool meshDirty;                 //The resident set changed since the level mesh was uploaded
+};
+//Texture unit used for a key (and for the doors it opens)
+inline int keyTexture(int keyCode){ return keyCode == CELL_KEY_PLATE ? 2 : 3; } //plate.bmp or PoolWater.bmp
+Level level;
+const char* mapFileName = "map2.txt";
+bool loadLevel(const char* fileName, Level& level);
+void unloadLevel(Level& level);
+bool parseLevel(const char* fileName, Level& level, vector<unsigned char>& image);
+void streamLevel(Level& level, glm::ivec2 playerCell);
+glm::ivec2 playerCell();
+//View frustum culling. The level's uniform grid of chunks doubles as the spatial index: each
+//resident chunk's bounding box is tested against the frustum planes once per frame.
+struct Frustum{
+  glm::vec4 planes[6]; //ax+by+cz+d >= 0 inside, (a,b,c) normalized
+};
+struct CullStats{
+  int tested, culled, drawn; //Blocks, summed over frames until reported
+  int pvsCulled;             //Culled blocks that were in the frustum but not in the PVS
+};
+Frustum viewFrustum;
+CullStats cullStats;
+void extractFrustum(const glm::mat4& viewProj, Frustum& frustum);
+bool boxInFrustum(const Frustum& frustum, glm::vec3 lo, glm::vec3 hi);
+const CellPVS* cellPVS = NULL; //PVS of the player's cell this frame, NULL when not culling by PVS
+bool firstPerson = false;
+glm::vec2 facing(0,1);       //(column, row) direction the knot last moved in
+const CellPVS* levelPVS(Level& level, glm::ivec2 cell);
+void pvsDoorChanged(Level& level, int row, int col);
+bool pvsVisible(const CellPVS* pvs, glm::ivec2 center, int row, int col);
+void cullLevel(Level& level, const Frustum& frustum, const CellPVS* pvs);
+
+//Lights: point lights (torches along the walls, the player's lantern, a glow around each key)
+//are a component of the entities. Every frame the ones whose sphere reaches into the view are
+//binned into clusters, a grid of CLUSTER_TILE pixel screen tiles cut into depth slices, on the
+//job threads, and handed to the fragment shader as texture buffers. A fragment finds its
+//cluster from its pixel and view depth and only loops over that cluster's lights, so shading
+//costs what the lights on screen overlap, not how many the level has.
+const int CLUSTER_TILE = 64;   //Pixels
+const int CLUSTER_SLICES = 16; //Depth slices, thinner near the eye (exponential from near to far)
+const int LIGHT_DATA_UNIT = 1, LIGHT_GRID_UNIT = 2, LIGHT_INDEX_UNIT = 3; //Texture units of the buffers below
+struct LightGPU{          //Two RGBA32F texels of the light data buffer
+  glm::vec4 viewPosition; //w is the radius
+  glm::vec4 color;        //w unused
+};
+struct LightBin{ //The clusters a light's bounding box covers, inclusive
+  short x0, x1, y0, y1, z0, z1;
+};
+struct LightClusters{
+  int tilesX, tilesY;
+  vector<LightGPU> lights;       //In view this frame
+  vector<LightBin> bins;
+  vector<unsigned int> grid;     //Per cluster: first entry in indices, count
+  vector<unsigned int> indices;  //Lights, cluster after cluster
+  vector< vector<unsigned int> > sliceIndices; //Each depth slice's part of indices, built by its own job
+  GLuint buffers[3], textures[3]; //Light data, grid, indices
+};
+LightClusters lightClusters;
+int torchSpacing = 24; //One torch per about this many cells along the walls (-torches, 0 for none)
+void startLights(LightClusters& lights);
+void stopLights(LightClusters& lights);
+void binLights(LightClusters& lights);
+
+//Job system: the scene traversal (culling the resident chunks, then the entities, and building
+//the draw lists) is split into jobs run by a worker per core plus the GL thread (thread 0).
+//parallelFor hands out a range as one job that keeps splitting its top half off into its
+//thread's queue until what is left is grain items. Idle threads steal the oldest (biggest)
+//pieces from the other queues, owners pop their own newest.
+typedef void (*JobFunction)(void* data, int begin, int end, int self);
+struct Job{
+  JobFunction run;
+  void* data;
+  int begin, end, grain;
+  std::atomic<int>* pending; //Pieces of its parallelFor not yet run
+};
+struct JobQueue{
+  mutex lock;
+  deque<Job> jobs;
+};
+struct JobSystem{
+  int numThreads;         //Including the GL thread, 0 (or 1) runs everything on the GL thread
+  vector<thread> workers;
+  JobQueue* queues;       //One per thread
+  std::atomic<int> queued; //Jobs in all the queues together
+  mutex sleepLock;
+  condition_variable wake;
+  bool quit;
+};
+JobSystem jobSystem;
+int jobThreads = 0; //-jobs, 0 = one per core
+void startJobSystem(JobSystem& js, int numThreads);
+void stopJobSystem(JobSystem& js);
+void parallelFor(JobSystem& js, int count, int grain, JobFunction run, void* data);
+
+//Each thread's output from the traversal, allocated from its frame arena (a bump allocator
+//that is emptied every frame): visible chunks to draw, props already through the transform
+//stage, and its share of the culling counts. queueLevelMesh and queueProps merge them.
+struct FrameArena{
+  char* memory;
+  size_t capacity, used;  //used counts what didn't fit too, the arena grows to it at the next reset
+  vector<void*> overflow;
+  FrameArena() : memory(NULL), capacity(0), used(0) {}
+};
+const int PROP_BLOCK = 128, CHUNK_BLOCK = 32;
+struct PropBlock{
+  PropBlock* next;
+  int count;
+  unsigned char model[PROP_BLOCK], lod[PROP_BLOCK];
+  PropGPU gpu[PROP_BLOCK];
+};
+struct ChunkBlock{
+  ChunkBlock* next;
+  int count;
+  int chunk[CHUNK_BLOCK]; //Into level.chunks
+};
+struct DrawList{
+  FrameArena arena;
+  PropBlock* props;
+  ChunkBlock* chunks;
+  CullStats cull;
+  TransformBatch transforms; //Scratch for this thread's jobs
+  vector<int> picked;        //Entities in transforms
+  vector<LightGPU> lights;   //In view, for binLights
+};
+vector<DrawList> drawLists; //One per job thread
+void* arenaAlloc(FrameArena& arena, size_t bytes);
+void resetArena(FrameArena& arena);
+void resetDrawLists();
+
+//The resident chunk meshes are packed into one vertex buffer and drawn with a single call.
+//It is only rebuilt when chunks are paged in or out.
+GLuint levelVao, levelVbo, levelEbo;
+int levelQuads = 0, levelEboQuads = 0;
+void queueLevelMesh(Level& level, GLuint program, GLuint texture, RenderQueue& queue);
+bool generateMaze(int width, int height, const char* fileName);
+void buildChunkMesh(const Level& level, MapChunk& chunk);
+void printLevelInfo(const char* fileName, const Level& level);
+void watchLevelFile(const char* fileName);
+bool levelFileChanged();
+void drawGeometry();
 void drawSquare();
-bool isWalkable(float x, float y);
 void setCamDirFromAngle(float camAngle);
 void setCamDirFromAngle(float camAngle){
   CameraDirY = sin(camAngle);
   CameraDirX = cos(camAngle);
 }
 int main(int argc, char *argv[]){
-	SDL_Init(SDL_INIT_VIDEO);  //Initialize Graphics (for OpenGL)
+	Uint64 programStart = SDL_GetPerformanceCounter();
+	//Command line: -map <file> picks the level, -reparsemap re-reads the map file every frame
+	//(the old behaviour, kept so frame times can be compared against parsing the level once),
+	//-genmaze <width> <height> <file> writes a random maze map and exits, -cooktextures cooks the
+	//textures (see TextureCacheHeader) and exits, -compresstextures uses BC1 compressed textures,
+	//-pacing vsync|adaptive|uncapped picks how frames are paced and -nowait lets the CPU run ahead
+	//of the display (more throughput, more input latency), -benchmark <frames> [-json <file>]
+	//renders that many frames headless and reports how long they took, -record <prefix> records
+	//every frame from the start as <prefix>00000.ppm..., -recordpipe "<command>" records by piping
+	//raw RGB frames to command instead (e.g. "ffmpeg -f rawvideo -pix_fmt rgb24 -s 1000x800 -i - out.mp4"),
+	//-trace <file> <frames> writes a trace of the first frames (0 for all of them), -profile shows
+	//the profiler overlay from the start, -agents <n> fills the level with agents that chase the knot
+	//or head for the keys and doors, -navbench <n> times the navigation for n agents and exits,
+	//-jobs <n> builds each frame on n threads instead of one per core, and
+	//-torches <n> puts a torch on the walls around one in n cells (0 for none). The tools that exit
+	//run once every argument is read, so they get the -map and -compresstextures given in any order.
+	bool reparseMapEveryFrame = false;
+	const char* mazeFile = NULL;
+	int mazeWidth = 0, mazeHeight = 0, navBenchAgents = 0;
+	bool cookTextures = false;
+	for (int i = 1; i < argc; i++){
+		if (strcmp(argv[i], "-map") == 0 && i+1 < argc) mapFileName = argv[++i];
+		else if (strcmp(argv[i], "-reparsemap") == 0) reparseMapEveryFrame = true;
+		else if (strcmp(argv[i], "-genmaze") == 0 && i+3 < argc){
+			mazeWidth = atoi(argv[++i]);
+			mazeHeight = atoi(argv[++i]);
+			mazeFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-compresstextures") == 0) compressTextures = true;
+		else if (strcmp(argv[i], "-pacing") == 0 && i+1 < argc){
+			i++;
+			for (int p = 0; p < 3; p++) if (strncmp(argv[i], pacingNames[p], strlen(argv[i])) == 0) framePacing = p;
+		}
+		else if (strcmp(argv[i], "-nowait") == 0) waitForPresent = false;
+		else if (strcmp(argv[i], "-benchmark") == 0 && i+1 < argc) benchmarkFrames = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-json") == 0 && i+1 < argc) benchmarkJson = argv[++i];
+		else if (strcmp(argv[i], "-record") == 0 && i+1 < argc){
+			capture.prefix = argv[++i];
+			capture.recording = true;
+		}
+		else if (strcmp(argv[i], "-trace") == 0 && i+2 < argc){
+			profiler.traceFile = argv[++i];
+			profiler.traceFrames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-profile") == 0) profiler.overlay = true;
+		else if (strcmp(argv[i], "-agents") == 0 && i+1 < argc) agentCount = max(0, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-torches") == 0 && i+1 < argc) torchSpacing = max(0, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-jobs") == 0 && i+1 < argc) jobThreads = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-navbench") == 0 && i+1 < argc) navBenchAgents = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-recordpipe") == 0 && i+1 < argc){
+			capture.pipeCommand = argv[++i];
+			capture.recording = true;
+		}
+		else if (strcmp(argv[i], "-cooktextures") == 0) cookTextures = true;
+	}
+	if (mazeFile) return generateMaze(mazeWidth, mazeHeight, mazeFile) ? 0 : 1;
+	if (cookTextures){
+		bool ok = true;
+		for (int t = 0; t < NUM_MATERIALS; t++){
+			if (!cookTexture(materialFiles[t], compressTextures ? TEXTURE_BC1 : TEXTURE_BGRA8)) ok = false;
+		}
+		return ok ? 0 : 1;
+	}
+	if (navBenchAgents > 0) return benchmarkNavigation(mapFileName, navBenchAgents) ? 0 : 1;
+
+	SDL_Window* window = NULL;
+	SDL_GLContext context = NULL;
+	GLADloadproc glLoader = SDL_GL_GetProcAddress;
+	bool headless = benchmarkFrames > 0;
+	if (headless){
+		if (!createHeadlessContext(&glLoader)) return 1;
+	}
+	else {
+		SDL_Init(SDL_INIT_VIDEO);  //Initialize Graphics (for OpenGL)
 
-	//Ask SDL to get a recent version of OpenGL (3.2 or greater)
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
+		//Ask SDL to get a recent version of OpenGL (3.3 or greater, we need instanced vertex attributes)
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
 
-	//Create a window (offsetx, offsety, width, height, flags)
-	SDL_Window* window = SDL_CreateWindow("My OpenGL Program", 100, 100, screenWidth, screenHeight, SDL_WINDOW_OPENGL);
+		//Create a window (offsetx, offsety, width, height, flags)
+		window = SDL_CreateWindow("My OpenGL Program", 100, 100, screenWidth, screenHeight, SDL_WINDOW_OPENGL);
 
-	//Create a context to draw in
-	SDL_GLContext context = SDL_GL_CreateContext(window);
+		//Create a context to draw in
+		context = SDL_GL_CreateContext(window);
+	}
 
 	//Load OpenGL extentions with GLAD
-	if (gladLoadGLLoader(SDL_GL_GetProcAddress)){
+	if (gladLoadGLLoader(glLoader)){
 		printf("\nOpenGL loaded\n");
 		printf("Vendor:   %s\n", glGetString(GL_VENDOR));
 		printf("Renderer: %s\n", glGetString(GL_RENDERER));
@@ -160,60 +943,6 @@ int main(int argc, char *argv[]){
 		return -1;
 	}
 
-	//Here we will load two different model files
-
-
-
-	//Load Model 1
-	ifstream modelFile;
-	modelFile.open("models/teapot.txt");
-	int numLines = 0;
-	modelFile >> numLines;
-	float* model1 = new float[numLines];
-	for (int i = 0; i < numLines; i++){
-		modelFile >> model1[i];
-	}
-	printf("%d\n",numLines);
-	int numVertsTeapot = numLines/8;
-	modelFile.close();
-
-	//Load Model 2
-	modelFile.open("models/knot.txt");
-	numLines = 0;
-	modelFile >> numLines;
-	float* model2 = new float[numLines];
-	for (int i = 0; i < numLines; i++){
-		modelFile >> model2[i];
-	}
-	printf("%d\n",numLines);
-	int numVertsKnot = numLines/8;
-	modelFile.close();
-
-  //Load Model 3
-	modelFile.open("models/cube.txt");
-	numLines = 0;
-	modelFile >> numLines;
-	float* model3 = new float[numLines];
-	for (int i = 0; i < numLines; i++){
-		modelFile >> model3[i];
-	}
-	printf("%d\n",numLines);
-	int numVertsCube = numLines/8;
-	modelFile.close();
-
-//Load Model 4
-modelFile.open("models/sphere.txt");
-numLines = 0;
-modelFile >> numLines;
-string s;
-float* model4 = new float[numLines];
-for (int i = 0; i < numLines; i++){
-  modelFile >> model4[i];
-}
-printf("%d\n",numLines);
-int numVertsSphere = numLines/8;
-modelFile.close();
-
   //Load the vertex Shader
   GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
   glShaderSource(vertexShader, 1, &vertexSource, NULL);
@@ -230,176 +959,149 @@ modelFile.close();
   glBindFragDataLocation(shaderProgram, 0, "outColor"); // set output
   glLinkProgram(shaderProgram); //run the linker
 
-	//SJG: I load each model in a different array, then concatenate everything in one big array
-	// This structure works, but there is room for improvement here. Eg., you should store the start
-	// and end of each model a data structure or array somewhere.
-	//Concatenate model arrays
-	float* modelData = new float[(numVertsTeapot+numVertsKnot+numVertsCube+numVertsSphere)*8];
-	copy(model1, model1+numVertsTeapot*8, modelData);
-	copy(model2, model2+numVertsKnot*8, modelData+numVertsTeapot*8);
-  copy(model3, model3+numVertsCube*8, (modelData+numVertsTeapot*8+numVertsKnot*8));
-  copy(model4, model4+numVertsSphere*8, (modelData+numVertsTeapot*8+numVertsKnot*8+numVertsCube*8));
-
-	int totalNumVerts = numVertsTeapot+numVertsKnot+numVertsCube+numVertsSphere;
-	int startVertTeapot = 0;  //The teapot is the first model in the VBO
-	int startVertKnot = numVertsTeapot; //The knot starts right after the taepot
-  int startVertCube = numVertsTeapot + numVertsKnot; //The squarestarts right after the knot
-  int startVertSphere = numVertsTeapot + numVertsKnot + numVertsCube; //The sphere starts right after the square
 
 
 
 
 
-	//// Allocate Texture 0 (Wood) ///////
-	SDL_Surface* surface = SDL_LoadBMP("wood.bmp");
-	if (surface==NULL){ //If it failed, print the error
-        printf("Error: \"%s\"\n",SDL_GetError()); return 1;
-    }
-    GLuint tex0;
-    glGenTextures(1, &tex0);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tex0);
-
-    //What to do outside 0-1 range
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    //Load the texture into memory
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surface->w,surface->h, 0, GL_BGR,GL_UNSIGNED_BYTE,surface->pixels);
-    glGenerateMipmap(GL_TEXTURE_2D); //Mip maps the texture
-
-    SDL_FreeSurface(surface);
-    //// End Allocate Texture ///////
-
-
-	//// Allocate Texture 1 (Brick) ///////
-	SDL_Surface* surface1 = SDL_LoadBMP("brick.bmp");
-	if (surface==NULL){ //If it failed, print the error
-        printf("Error: \"%s\"\n",SDL_GetError()); return 1;
-    }
-    GLuint tex1;
-    glGenTextures(1, &tex1);
-
-    //Load the texture into memory
-    glActiveTexture(GL_TEXTURE1);
-
-    glBindTexture(GL_TEXTURE_2D, tex1);
-    //What to do outside 0-1 range
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    //How to filter
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surface1->w,surface1->h, 0, GL_BGR,GL_UNSIGNED_BYTE,surface1->pixels);
-    glGenerateMipmap(GL_TEXTURE_2D); //Mip maps the texture
-
-    SDL_FreeSurface(surface1);
-	//// End Allocate Texture ///////
-
-  //// Allocate Texture 3 (Plate) ///////
-  SDL_Surface* surface2 = SDL_LoadBMP("plate.bmp");
-  if (surface2==NULL){ //If it failed, print the error
-        printf("Error: \"%s\"\n",SDL_GetError()); return 1;
-    }
-    GLuint tex2;
-    glGenTextures(1, &tex2);
-
-    //Load the texture into memory
-    glActiveTexture(GL_TEXTURE2);
-
-    glBindTexture(GL_TEXTURE_2D, tex2);
-    //What to do outside 0-1 range
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    //How to filter
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surface2->w,surface2->h, 0, GL_BGR,GL_UNSIGNED_BYTE,surface2->pixels);
-    glGenerateMipmap(GL_TEXTURE_2D); //Mip maps the texture
-
-    SDL_FreeSurface(surface2);
-  //// End Allocate Texture ///////
-
-  //// Allocate Texture 4 (Plate) ///////
-  SDL_Surface* surface3 = SDL_LoadBMP("PoolWater.bmp");
-  if (surface3==NULL){ //If it failed, print the error
-        printf("Error: \"%s\"\n",SDL_GetError()); return 1;
-    }
-    GLuint tex3;
-    glGenTextures(1, &tex3);
-
-    //Load the texture into memory
-    glActiveTexture(GL_TEXTURE3);
-
-    glBindTexture(GL_TEXTURE_2D, tex3);
-    //What to do outside 0-1 range
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    //How to filter
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surface3->w,surface3->h, 0, GL_BGR,GL_UNSIGNED_BYTE,surface3->pixels);
-    glGenerateMipmap(GL_TEXTURE_2D); //Mip maps the texture
-
-    SDL_FreeSurface(surface3);
-  //// End Allocate Texture ///////
-
-	//Build a Vertex Array Object (VAO) to store mapping of shader attributse to VBO
-	GLuint vao;
-	glGenVertexArrays(1, &vao); //Create a VAO
-	glBindVertexArray(vao); //Bind the above created VAO to the current context
+	//// Allocate Textures ///////
+	//All of them go into one texture array that stays bound for the whole run. It starts out
+	//with a placeholder in every layer, the asset loader fills in the real textures.
+	GLuint materialTex = createMaterialArray(NUM_MATERIALS);
+	//// End Allocate Textures ///////
 
 	//Allocate memory on the graphics card to store geometry (vertex buffer object)
 	GLuint vbo[1];
 	glGenBuffers(1, vbo);  //Create 1 buffer called vbo
-	glBindBuffer(GL_ARRAY_BUFFER, vbo[0]); //Set the vbo as the active array buffer (Only one buffer can be active at a time)
-	glBufferData(GL_ARRAY_BUFFER, totalNumVerts*8*sizeof(float), modelData, GL_STATIC_DRAW); //upload vertices to vbo
-	//GL_STATIC_DRAW means we won't change the geometry, GL_DYNAMIC_DRAW = geometry changes infrequently
-	//GL_STREAM_DRAW = geom. changes frequently.  This effects which types of GPU memory is used
-
-	int texturedShader = InitShader("textured-Vertex.glsl", "textured-Fragment.glsl");
-
-	//Tell OpenGL how to set fragment shader input
-	GLint posAttrib = glGetAttribLocation(texturedShader, "position");
-	glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 8*sizeof(float), 0);
-	  //Attribute, vals/attrib., type, isNormalized, stride, offset
-	glEnableVertexAttribArray(posAttrib);
-
-	//GLint colAttrib = glGetAttribLocation(phongShader, "inColor");
-	//glVertexAttribPointer(colAttrib, 3, GL_FLOAT, GL_FALSE, 8*sizeof(float), (void*)(3*sizeof(float)));
-	//glEnableVertexAttribArray(colAttrib);
 
-	GLint normAttrib = glGetAttribLocation(texturedShader, "inNormal");
-	glVertexAttribPointer(normAttrib, 3, GL_FLOAT, GL_FALSE, 8*sizeof(float), (void*)(5*sizeof(float)));
-	glEnableVertexAttribArray(normAttrib);
-
-	GLint texAttrib = glGetAttribLocation(texturedShader, "inTexcoord");
-	glEnableVertexAttribArray(texAttrib);
-	glVertexAttribPointer(texAttrib, 2, GL_FLOAT, GL_FALSE, 8*sizeof(float), (void*)(3*sizeof(float)));
-
-	GLint uniView = glGetUniformLocation(texturedShader, "view");
-	GLint uniProj = glGetUniformLocation(texturedShader, "proj");
-
-	glBindVertexArray(0); //Unbind the VAO in case we want to create a new one
+	//The index buffer is part of the VAO state, so it gets bound with the prop VAO below
+	GLuint ebo;
+	glGenBuffers(1, &ebo);
+	//SJG: Both buffers are filled (and the attributes set up) by uploadModels once the asset
+	// loader has all the models
+
+	//The static level mesh has its own vertex format (LevelVertex) and buffers, see queueLevelMesh
+	ShaderProgram levelShader;
+	loadShaderProgram(levelShader, "level-Vertex.glsl", "textured-Fragment.glsl");
+	glGenVertexArrays(1, &levelVao);
+	glBindVertexArray(levelVao);
+	glGenBuffers(1, &levelVbo);
+	glGenBuffers(1, &levelEbo);
+	glBindBuffer(GL_ARRAY_BUFFER, levelVbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, levelEbo);
+	GLint levelPosAttrib = levelShader.attrib("position");
+	glVertexAttribPointer(levelPosAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(LevelVertex), (void*)offsetof(LevelVertex, position));
+	glEnableVertexAttribArray(levelPosAttrib);
+	GLint levelTexAttrib = levelShader.attrib("inTexcoord");
+	glVertexAttribPointer(levelTexAttrib, 2, GL_FLOAT, GL_FALSE, sizeof(LevelVertex), (void*)offsetof(LevelVertex, texcoord));
+	glEnableVertexAttribArray(levelTexAttrib);
+	GLint levelNormAttrib = levelShader.attrib("inNormal");
+	glVertexAttribPointer(levelNormAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(LevelVertex), (void*)offsetof(LevelVertex, normal));
+	glEnableVertexAttribArray(levelNormAttrib);
+	GLint levelTexIDAttrib = levelShader.attrib("inTexID");
+	glVertexAttribPointer(levelTexIDAttrib, 1, GL_FLOAT, GL_FALSE, sizeof(LevelVertex), (void*)offsetof(LevelVertex, texID));
+	glEnableVertexAttribArray(levelTexIDAttrib);
+	glBindVertexArray(0);
+
+	//Props (keys and the player) get their own VAO: the same model buffers plus a per-instance buffer
+	ShaderProgram propShader;
+	loadShaderProgram(propShader, "instanced-Vertex.glsl", "textured-Fragment.glsl");
+	glGenVertexArrays(1, &propVao);
+	glBindVertexArray(propVao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	glGenBuffers(1, &propInstanceVbo);
+	propMvpAttrib = propShader.attrib("instMVP");             //A mat4 takes 4 attribute slots,
+	propModelViewAttrib = propShader.attrib("instModelView"); //a mat3x4 takes 3
+	propNormalAttrib = propShader.attrib("instNormalMatrix");
+	propTexAttrib = propShader.attrib("instTexID");
+	for (int col = 0; col < 4; col++){
+		GLint slots[4] = {propMvpAttrib + col, col < 3 ? propModelViewAttrib + col : -1, col < 3 ? propNormalAttrib + col : -1, col == 0 ? propTexAttrib : -1};
+		for (int a = 0; a < 4; a++){
+			if (slots[a] < 0) continue;
+			glEnableVertexAttribArray(slots[a]);
+			glVertexAttribDivisor(slots[a], 1); //Advance once per instance, not per vertex
+		}
+	}
+	glBindVertexArray(0);
+
+	//One uniform buffer with the per frame state for both programs
+	glGenBuffers(1, &frameUbo);
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, frameUbo);
+	glGenBuffers(1, &meshDecodeUbo);
+	glBindBuffer(GL_UNIFORM_BUFFER, meshDecodeUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(MeshDecodeUniforms), NULL, GL_STATIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, MESH_DECODE_UBO_BINDING, meshDecodeUbo);
+	startLights(lightClusters);
+
+	//Parse the level once, after this the draw loop only reads the in-memory Level. Before the
+	//asset workers start, so a bad map is a plain error exit.
+	if (!loadLevel(mapFileName, level)) return 1;
+	printLevelInfo(mapFileName, level);
+	watchLevelFile(mapFileName);
+	//Once the context and the level are good, so none of the error exits above leave workers behind
+	startJobSystem(jobSystem, jobThreads > 0 ? jobThreads : SDL_GetCPUCount());
+
+	//Load the models and textures in the background, we start drawing right away
+	assets.modelVbo = vbo[0];
+	assets.modelEbo = ebo;
+	assets.modelVao = propVao;
+	assets.modelShader = &propShader;
+	assets.materialTex = materialTex;
+	assets.start = programStart;
+	startAssetLoading(assets);
 
 
 	glEnable(GL_DEPTH_TEST);
 
-	printf("%s\n",INSTRUCTIONS);
+	GLuint offscreenFbo = 0, offscreenBuffers[2];
+	vector<double> benchmarkMs;
+	vector<RenderStats> benchmarkStats;
+	if (headless){ //Nothing to pace or interact with, draw into a framebuffer object as fast as we can
+		offscreenFbo = createOffscreenTarget(screenWidth, screenHeight, offscreenBuffers);
+		waitForPresent = true; //Frame times include the GPU
+		while (assets.numDone < (int)assets.jobs.size()){ //Time the renderer, not the loading
+			if (!pumpAssets(assets)){
+				stopJobSystem(jobSystem);
+				stopAssetLoading(assets);
+				return 1;
+			}
+			SDL_Delay(1);
+		}
+	}
+	else {
+		printf("%s\n",INSTRUCTIONS);
+		setFramePacing(framePacing);
+	}
+	startCapture(capture, screenWidth, screenHeight);
+	startProfiler(profiler);
 
 	//Event Loop (Loop forever processing each event as fast as possible)
 	SDL_Event windowEvent;
 	bool quit = false;
+	bool firstFrame = true;
+	double frameMsTotal = 0; //CPU time per frame (excluding the buffer swap), averaged for reporting
+	double mapMsTotal = 0;   //Of which re-reading the map (-reparsemap)
+	Level reparsedLevel;
+	vector<unsigned char> reparsedImage;
+	int framesTimed = 0;
+
+	Uint64 lastCounter = SDL_GetPerformanceCounter();
+	double tickTime = 0;    //Real time not yet simulated
+	long long ticks = 0;
+	Uint32 inputStamp = 0;  //When the oldest key press not yet on screen happened (0 if none)
+	double latencyMsTotal = 0;
+	int latencySamples = 0;
 
 	while (!quit){
-    float t_start = SDL_GetTicks()/1000.f;
-		while (SDL_PollEvent(&windowEvent)){  //inspect all events in the queue
+    Uint64 frameStart = SDL_GetPerformanceCounter();
+		profileBeginFrame(profiler);
+		ProfileScope frameZone("Frame");
+		renderStats = RenderStats();
+		ProfileScope eventZone("Events");
+		while (!headless && SDL_PollEvent(&windowEvent)){  //inspect all events in the queue
 
 			if (windowEvent.type == SDL_QUIT) quit = true;
 			//List of keycodes: https://wiki.libsdl.org/SDL_Keycode - You can catch many special keys
@@ -411,90 +1113,69 @@ modelFile.close();
 				SDL_SetWindowFullscreen(window, fullscreen ? SDL_WINDOW_FULLSCREEN : 0); //Toggle fullscreen
 			}
 
-			//SJG: Use key input to change the state of the object
-			//     We can use the ".mod" flag to see if modifiers such as shift are pressed
-			if (windowEvent.type == SDL_KEYDOWN && windowEvent.key.keysym.sym == SDLK_UP){ //If "up key" is pressed
-				if (windowEvent.key.keysym.mod & KMOD_SHIFT) objx -= .1; //Is shift pressed?
-				else   //CameraPosZ -= 0.1;//(velocity*CameraDirZ* time_per_frame * 0.2 );
-              //CameraPosY -= 0.1*CameraDirY;//(velocity*CameraDirY* time_per_frame * 0.2 );
-              //CameraPosZ-= CameraDirZ*0.1;
-              //CameraPosY-= CameraDirY*0.1;
-              if(isWalkable(objy,objz+=(velocity * time_per_frame * 0.03 ))){
-              objz+=(velocity * time_per_frame * 0.03);
-            }else{
-              objz-=0.09;
-            }
-
-
+			//SJG: The arrow keys are read every tick (see simTick), here we only note when they
+			//were first pressed so we can time how long it takes for that to reach the screen
+			if (windowEvent.type == SDL_KEYDOWN && !windowEvent.key.repeat && inputStamp == 0){
+				SDL_Keycode k = windowEvent.key.keysym.sym;
+				if (k == SDLK_UP || k == SDLK_DOWN || k == SDLK_LEFT || k == SDLK_RIGHT) inputStamp = windowEvent.key.timestamp;
 			}
-			if (windowEvent.type == SDL_KEYDOWN && windowEvent.key.keysym.sym == SDLK_DOWN){ //If "down key" is pressed
-				if (windowEvent.key.keysym.mod & KMOD_SHIFT) objx += .1; //Is shift pressed?
-				else CameraPosZ+= CameraDirZ*0.1;
-        //CameraPosY+= CameraDirY*0.1;
-        if(isWalkable(objy,objz-=(velocity * time_per_frame * 0.03 ))){
-        objz-=(velocity * time_per_frame * 0.03);
-      }else{
-        objz+=0.09;
-      }
-
+			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_v){ //If "v" is pressed
+				firstPerson = !firstPerson;
 			}
-				if (windowEvent.type == SDL_KEYDOWN && windowEvent.key.keysym.sym == SDLK_LEFT){ //If "up key" is pressed
-				//CameraDirY += CameraAngle*0.3;//(velocity * time_per_frame * 0.2);
-        //CameraAngle += 0.1f;
-  			//CameraDirY = sin(CameraAngle);
-  			//CameraDirZ = -cos(CameraAngle);
-        if(isWalkable(objy-=(velocity*time_per_frame * 0.03 ),objz)){
-        objy-=(velocity* time_per_frame * 0.03);
-        }else{
-        objy+=0.09;
-        }
-
+			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_p){ //If "p" is pressed
+				setFramePacing((framePacing+1)%3);
 			}
-			if (windowEvent.type == SDL_KEYDOWN && windowEvent.key.keysym.sym == SDLK_RIGHT){ //If "down key" is pressed
-				//CameraDirY -=CameraAngle*0.3;
-        //CameraAngle += 0.1f;
-        //CameraDirY = -sin(CameraAngle);
-        //CameraDirZ = cos(CameraAngle);
-
-        if(isWalkable(objy+=(velocity*time_per_frame * 0.03),objz)){
-        objy+=(velocity*time_per_frame * 0.03 );
-      }else{
-        objy-=0.09;
-      }
+			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_r){ //If "r" is pressed
+				capture.recording = !capture.recording;
+				printf("%s recording\n", capture.recording ? "Started" : "Stopped");
+			}
+			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_s){ //If "s" is pressed
+				Win2PPM(screenWidth, screenHeight);
+			}
+			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_o){ //If "o" is pressed
+				profiler.overlay = !profiler.overlay;
+			}
+			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_t){ //If "t" is pressed
+				if (profiler.trace) stopTrace(profiler);
+				else startTrace(profiler, "trace.json", 0);
 			}
 			if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_c){ //If "c" is pressed
 				colR = rand01();
 				colG = rand01();
 				colB = rand01();
 			}
-      if (windowEvent.type == SDL_MOUSEMOTION && windowEvent.button.button == SDL_BUTTON(SDL_BUTTON_LEFT)){ //If "c" is pressed
-        glm::mat4 view = glm::lookAt(
-        glm::vec3(3.f, 0.f, 0.f),  //Cam Position
-        glm::vec3(0.0f, 0.0f+sin(20), 0.0f),  //Look at point
-        glm::vec3( CameraUpX,  CameraUpY, CameraUpZ)); //Up
-        glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));
-			}
-      /*glm::mat4 view = glm::lookAt(
-      glm::vec3(3.f, objy, objz),  //Cam Position
-      glm::vec3(0.0f, 1.0f, 0.0f),  //Look at point
-      glm::vec3( CameraUpX,  CameraUpY, CameraUpZ)); //Up
-      glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));*/
 		}
+
+		eventZone.end();
+
+		//Run as many ticks as the real time since the last frame covers
+		ProfileScope simZone("Simulate");
+		Uint64 now = SDL_GetPerformanceCounter();
+		tickTime += headless ? 1/60.0 : (now-lastCounter)/(double)SDL_GetPerformanceFrequency(); //Benchmarks simulate the same way every run
+		lastCounter = now;
+		if (tickTime > MAX_TICKS_PER_FRAME*TICK_SECONDS) tickTime = MAX_TICKS_PER_FRAME*TICK_SECONDS;
+		static const Uint8 noKeys[SDL_NUM_SCANCODES] = {0};
+		const Uint8* keys = headless ? noKeys : SDL_GetKeyboardState(NULL);
+		while (tickTime >= TICK_SECONDS){
+			simTick(keys);
+			tickTime -= TICK_SECONDS;
+			ticks++;
+		}
+		float alpha = tickTime/TICK_SECONDS; //How far we are into the next tick
+		interpolateSim(alpha);
+		timePast = (ticks + alpha)*TICK_SECONDS;
+		simZone.end();
     //cout<<velocity<<endl;
 		// Clear the screen to default color
+		ProfileScope clearZone("Clear", true);
 		glClearColor(.2f, 0.4f, 0.8f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		glUseProgram(texturedShader);
-
-
-		timePast = SDL_GetTicks()/1000.f;
+		clearZone.end();
 
 		glm::mat4 view = glm::lookAt(
 		glm::vec3(7.f, 2.f, 0.f),  //Cam Position
 		glm::vec3(1.0f, 2.0f, 2.0f),  //Look at point
 		glm::vec3(0.0f, 0.0f, 1.0f)); //Up
-    glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));
     /*glm::mat4 view = glm::lookAt(
     glm::vec3( CameraPosX,  CameraPosY, CameraPosZ),  //Cam Position
     glm::vec3( CameraDirX,  CameraDirY, CameraDirZ), //Up,  //Look at point
@@ -502,337 +1183,3318 @@ modelFile.close();
 		glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));*/
 
 		glm::mat4 proj = glm::perspective(3.14f/4, screenWidth / (float) screenHeight, 1.0f, 10.0f); //FOV, aspect, near, far
-		glUniformMatrix4fv(uniProj, 1, GL_FALSE, glm::value_ptr(proj));
-
-
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, tex0);
-		glUniform1i(glGetUniformLocation(texturedShader, "tex0"), 0);
-
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, tex1);
-		glUniform1i(glGetUniformLocation(texturedShader, "tex1"), 1);
-
-    glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, tex2);
-		glUniform1i(glGetUniformLocation(texturedShader, "tex2"), 2);
-
-    glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, tex3);
-		glUniform1i(glGetUniformLocation(texturedShader, "tex3"), 3);
-
-		glBindVertexArray(vao);
-
-		drawGeometry(texturedShader, startVertTeapot, numVertsTeapot, startVertKnot, numVertsKnot, startVertCube, numVertsCube, startVertSphere, numVertsSphere);
-
+		if (firstPerson){ //Look out from the knot in the direction it last moved (x is up in the maze)
+			glm::vec3 eye = entityDrawPosition(entities, entities.player) + glm::vec3(0.2f, 0, 0);
+			view = glm::lookAt(eye, eye + glm::vec3(0, facing.x, facing.y), glm::vec3(1,0,0));
+			proj = glm::perspective(3.14f/3, screenWidth / (float) screenHeight, 0.05f, 10.0f); //Corridors are narrow
+		}
+		if (headless) benchmarkCamera(benchmarkMs.size(), benchmarkFrames, view, proj);
+		updateFrameUniforms(view, proj); //Once, for every program
+
+		ProfileScope mapZone("Map");
+		if (reparseMapEveryFrame){ //Into a scratch level, the game carries on with the one it has
+			Uint64 mapStart = SDL_GetPerformanceCounter();
+			parseLevel(mapFileName, reparsedLevel, reparsedImage);
+			mapMsTotal += elapsedMs(mapStart);
+		}
+		else if (levelFileChanged()){ //Hot reload the map when it is edited
+			if (loadLevel(mapFileName, level)) printLevelInfo(mapFileName, level);
+		}
+		mapZone.end();
+		ProfileScope assetZone("Assets", true);
+		if (!pumpAssets(assets)) break; //Upload whatever the asset loader has finished
+		assetZone.end();
+		ProfileScope cullZone("Stream and cull");
+		streamLevel(level, playerCell()); //Page chunks in and out around the player
+		extractFrustum(proj * view, viewFrustum);
+		//From the knot's eyes the walls hide most of the maze, so also cull by what its cell can see
+		cellPVS = firstPerson ? levelPVS(level, playerCell()) : NULL;
+		cullLevel(level, viewFrustum, cellPVS); //Only chunks on screen (and in the PVS) get drawn
+		cullZone.end();
+
+		ProfileScope geometryZone("drawGeometry", true);
+		drawGeometry();
+		geometryZone.end();
+		ProfileScope lightsZone("Lights");
+		binLights(lightClusters); //The lights drawGeometry found, for the fragment shader
+		lightsZone.end();
+
+		//The floors and walls of the whole resident level in one draw, and all the props
+		//drawGeometry queued up in one instanced draw per model, through the render queue
+		ProfileScope queueZone("Queue");
+		queueLevelMesh(level, levelShader.id, materialTex, renderQueue);
+		queueProps(modelRanges, propShader.id, materialTex, projectionFar(proj), renderQueue);
+		queueZone.end();
+		ProfileScope submitZone("Submit", true);
+		submitRenderQueue(renderQueue, glState);
+		submitZone.end();
+
+		frameMsTotal += elapsedMs(frameStart);
+		if (++framesTimed == 500){
+			printf("Average frame time: %.3f ms (%s)\n", frameMsTotal/framesTimed,
+			       reparseMapEveryFrame ? "map re-read every frame" : "map parsed once");
+			if (reparseMapEveryFrame) printf("Map re-read: %.3f ms per frame\n", mapMsTotal/framesTimed);
+			printf("Blocks per frame: %.1f tested, %.1f culled (%.1f by the PVS), %.1f drawn\n", cullStats.tested/(float)framesTimed,
+			       cullStats.culled/(float)framesTimed, cullStats.pvsCulled/(float)framesTimed, cullStats.drawn/(float)framesTimed);
+			if (latencySamples > 0) printf("Input to present: %.1f ms over %d key presses (%s%s)\n", latencyMsTotal/latencySamples,
+			                               latencySamples, pacingNames[framePacing], waitForPresent ? "" : ", not waiting for present");
+			frameMsTotal = 0;
+			mapMsTotal = 0;
+			framesTimed = 0;
+			latencyMsTotal = 0;
+			latencySamples = 0;
+			cullStats.tested = cullStats.culled = cullStats.pvsCulled = cullStats.drawn = 0;
+		}
 
-		SDL_GL_SwapWindow(window); //Double buffering
-    float t_end = SDL_GetTicks();
-		float time_per_frame = t_end-t_start;
+		ProfileScope captureZone("Capture");
+		captureFrame(capture); //Before the swap, while this frame is still in the back buffer
+		captureZone.end();
+		if (profiler.overlay) drawProfilerOverlay(profiler, window); //Not in recordings
+		ProfileScope swapZone("Swap");
+		if (!headless) SDL_GL_SwapWindow(window); //Double buffering
+		if (waitForPresent) glFinish(); //Block until this frame is out, so next frame's input is fresh
+		swapZone.end();
+		if (headless){
+			benchmarkMs.push_back(elapsedMs(frameStart));
+			benchmarkStats.push_back(renderStats);
+			if ((int)benchmarkMs.size() == benchmarkFrames){
+				reportBenchmark(mapFileName, benchmarkMs, benchmarkStats);
+				quit = true;
+			}
+		}
+		if (inputStamp != 0){
+			latencyMsTotal += SDL_GetTicks() - inputStamp;
+			latencySamples++;
+			inputStamp = 0;
+		}
+		if (firstFrame){
+			printf("First frame after %.1f ms\n", elapsedMs(programStart));
+			firstFrame = false;
+		}
 	}
 
 	//Clean Up
-	glDeleteProgram(texturedShader);
+	stopProfiler(profiler);
+	stopCapture(capture);
+	stopNavigation(nav);
+	stopJobSystem(jobSystem);
+	stopAssetLoading(assets);
+	glDeleteProgram(propShader.id);
+	glDeleteProgram(levelShader.id);
+	glDeleteBuffers(1, &frameUbo);
+	glDeleteBuffers(1, &meshDecodeUbo);
+	stopLights(lightClusters);
+	glDeleteTextures(1, &materialTex);
+	glDeleteBuffers(1, &levelVbo);
+	glDeleteBuffers(1, &levelEbo);
+	glDeleteVertexArrays(1, &levelVao);
+	glDeleteBuffers(1, &propInstanceVbo);
+	glDeleteVertexArrays(1, &propVao);
     glDeleteBuffers(1, vbo);
-    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &ebo);
 
+	if (headless){
+		glDeleteFramebuffers(1, &offscreenFbo);
+		glDeleteRenderbuffers(2, offscreenBuffers);
+		destroyHeadlessContext();
+		return 0;
+	}
 	SDL_GL_DeleteContext(context);
 	SDL_Quit();
 	return 0;
 }
-float distanceTest(int x1, int y1, int x2, int y2)
-{
-  //double calcdistance = sqrt(distancex - distancey);
-    // Calculating distance
-    return sqrt(pow(x2 - x1, 2) +
-                pow(y2 - y1, 2));
+void drawGeometry(){
+  //The floors and walls of the resident chunks are one static mesh (see buildChunkMesh),
+  //drawn by queueLevelMesh. Here we only queue up the doors, keys and us.
+  drawEntities(entities);
 }
 
-void drawGeometry(int shaderProgram, int model1_start, int model1_numVerts, int model2_start, int model2_numVerts, int square_start, int square_numVerts,int sphere_start, int sphere_numVerts){
-  //Load Map
-  std::ifstream infile("map2.txt");
-  int numLines = 0;
-  int mapArray[26];
-  std::string line;
-  int r = 0;
-while (std::getline(infile, line))
-{
-  std::istringstream iss(line);
-  int idx;
-  while (iss>>idx ) {
-
-	  mapArray[r] = idx;
-    r++;
+//Point the position/normal/texcoord attributes of the bound VAO at the bound VBO, using the
+//packed layout from the mesh cache header (see PackedVertex)
+void setModelAttribs(const ShaderProgram& shader, const MeshCacheHeader* layout){
+	static const char* names[NUM_ATTRIBS] = {"position", "inTexcoord", "inNormal"}; //ATTRIB_* order
+	for (int a = 0; a < NUM_ATTRIBS; a++){
+		GLint attrib = shader.attrib(names[a]);
+		const void* offset = (void*)(size_t)layout->attribs[a].offset;
+		if (layout->attribs[a].normalized){
+			glVertexAttribPointer(attrib, layout->attribs[a].components, layout->attribs[a].type, GL_TRUE, layout->vertexBytes, offset);
+			  //Attribute, vals/attrib., type, isNormalized, stride, offset
+		}
+		else glVertexAttribIPointer(attrib, layout->attribs[a].components, layout->attribs[a].type, layout->vertexBytes, offset);
+		glEnableVertexAttribArray(attrib);
 	}
-  numLines++;
-}
-//int map[mapArray[0]][mapArray[1]];
-int nextLine=2;
-for(int i = 0; i<numLines;i++){
-  for(int j = 0; j< 5; j++){
-    map[i][j] = mapArray[nextLine];
-    nextLine++;
-  }
-  //nextLine+=5;
 }
 
-  //cout<<floor(objy)<<" "<<floor(objz+4)<<endl;
-
-	GLint uniColor = glGetUniformLocation(shaderProgram, "inColor");
-	glm::vec3 colVec(colR,colG,colB);
-	glUniform3fv(uniColor, 1, glm::value_ptr(colVec));
-
-  GLint uniTexID = glGetUniformLocation(shaderProgram, "texID");
+//Fill the Frame uniform block shared by all the programs
+void updateFrameUniforms(const glm::mat4& view, const glm::mat4& proj){
+  FrameUniforms& frame = frameUniforms;
+  frame.view = view;
+  frame.proj = proj;
+  frame.viewLightDir = view * glm::vec4(glm::normalize(glm::vec3(-1,1,-1)), 0); //It's a vector!
+  frame.inColor = glm::vec4(colR, colG, colB, 1);
+  frame.time = timePast;
+  frame.clusterGrid[0] = (screenWidth + CLUSTER_TILE-1)/CLUSTER_TILE;
+  frame.clusterGrid[1] = (screenHeight + CLUSTER_TILE-1)/CLUSTER_TILE;
+  frame.clusterGrid[2] = CLUSTER_SLICES;
+  frame.clusterGrid[3] = CLUSTER_TILE;
+  frame.clusterDepth[0] = projectionNear(proj);
+  frame.clusterDepth[1] = projectionFar(proj);
+  frame.clusterDepth[2] = CLUSTER_SLICES / log(frame.clusterDepth[1] / frame.clusterDepth[0]);
+  glBindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+}
 
-	//************
-	//Draw model #1 the first time
-	//This model is stored in the VBO starting a offest model1_start and with model1_numVerts num of verticies
-	//*************
+//Near and far plane distances of a glm::perspective projection
+float projectionNear(const glm::mat4& proj){
+  return proj[3][2] / (proj[2][2] - 1);
+}
 
-	//Rotate model (matrix) based on how much time has past
-	glm::mat4 model = glm::mat4(1);
-	model = glm::rotate(model,timePast * 3.14f/2,glm::vec3(0.0f, 1.0f, 1.0f));
-	model = glm::rotate(model,timePast * 3.14f/4,glm::vec3(1.0f, 0.0f, 0.0f));
-	//model = glm::scale(model,glm::vec3(.2f,.2f,.2f)); //An example of scale
-	GLint uniModel = glGetUniformLocation(shaderProgram, "model");
-	glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model)); //pass model matrix to shader
+float projectionFar(const glm::mat4& proj){
+  return proj[3][2] / (proj[2][2] + 1);
+}
 
-	//Set which texture to use (-1 = no texture)
-	glUniform1i(uniTexID, 1);
+//Gather the props every thread's jobs found into one upload, and queue the instances of every
+//model at each level of detail as a single draw. farPlane is the projection's, for the depth
+//part of the sort keys.
+void queueProps(const MeshRange* models, GLuint program, GLuint texture, float farPlane, RenderQueue& queue){
+  const int NUM_SLOTS = NUM_MODELS*MAX_MESH_LODS; //model*MAX_MESH_LODS + lod
+  int counts[NUM_SLOTS] = {0};
+  float nearest[NUM_SLOTS];
+  for (int m = 0; m < NUM_SLOTS; m++) nearest[m] = 1e30f;
+  for (size_t t = 0; t < drawLists.size(); t++){
+    for (const PropBlock* block = drawLists[t].props; block != NULL; block = block->next){
+      for (int i = 0; i < block->count; i++){
+        int m = block->model[i]*MAX_MESH_LODS + block->lod[i];
+        counts[m]++;
+        //Sorted by the nearest instance. w of the origin in clip space is its view depth.
+        nearest[m] = min(nearest[m], block->gpu[i].transform.mvp[3][3]);
+      }
+    }
+  }
+  int first[NUM_SLOTS], total = 0;
+  for (int m = 0; m < NUM_SLOTS; m++){
+    if (models[m/MAX_MESH_LODS].numIndices == 0) counts[m] = 0; //Still loading
+    first[m] = total;
+    total += counts[m];
+  }
+  if (total == 0) return;
+
+  static vector<PropGPU> gpu;
+  gpu.resize(total);
+  int next[NUM_SLOTS];
+  memcpy(next, first, sizeof(next));
+  for (size_t t = 0; t < drawLists.size(); t++){
+    for (const PropBlock* block = drawLists[t].props; block != NULL; block = block->next){
+      for (int i = 0; i < block->count; i++){
+        int m = block->model[i]*MAX_MESH_LODS + block->lod[i];
+        if (counts[m] > 0) gpu[next[m]++] = block->gpu[i];
+      }
+    }
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, propInstanceVbo);
+  glBufferData(GL_ARRAY_BUFFER, total*sizeof(PropGPU), NULL, GL_STREAM_DRAW); //Orphan last frame's data
+  glBufferSubData(GL_ARRAY_BUFFER, 0, total*sizeof(PropGPU), gpu.data());
+  for (int m = 0; m < NUM_SLOTS; m++){
+    int count = counts[m];
+    if (count == 0) continue;
+    const MeshRange& model = models[m/MAX_MESH_LODS];
+    const MeshLod& lod = model.lods[m%MAX_MESH_LODS];
+    RenderCommand draw = {program, propVao, texture, DRAW_INSTANCED, (GLsizei)lod.numIndices, lod.firstIndex,
+                          (GLint)model.baseVertex, count, first[m]*sizeof(PropGPU)};
+    queueDraw(queue, renderKey(program, texture, propVao << 8 | m, nearest[m]/farPlane), draw);
+    renderStats.triangles += (long long)lod.numIndices/3*count;
+    renderStats.vertices += (long long)lod.numIndices*count;
+  }
+  //The instance data moved, so every slice has to be pointed at again
+  glState.propInstanceBase = (size_t)-1;
+}
 
-	//Draw an instance of the model (at the position & orientation specified by the model matrix above)
-	//glDrawArrays(GL_TRIANGLES, model1_start, model1_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
+//// Job System ///////
+
+static bool takeJob(JobSystem& js, int self, Job& job){
+  if (js.queued == 0) return false;
+  for (int i = 0; i < js.numThreads; i++){
+    JobQueue& queue = js.queues[(self + i) % js.numThreads];
+    lock_guard<mutex> lock(queue.lock);
+    if (queue.jobs.empty()) continue;
+    if (i == 0){ //Our own newest, the smallest piece and the one most likely in cache
+      job = queue.jobs.back();
+      queue.jobs.pop_back();
+    }
+    else { //Steal the oldest, the biggest piece
+      job = queue.jobs.front();
+      queue.jobs.pop_front();
+    }
+    js.queued--;
+    return true;
+  }
+  return false;
+}
 
+static void pushJob(JobSystem& js, int self, const Job& job){
+  {
+    lock_guard<mutex> lock(js.queues[self].lock);
+    js.queues[self].jobs.push_back(job);
+  }
+  js.queued++;
+  {
+    lock_guard<mutex> lock(js.sleepLock); //So a worker can't miss this between checking and sleeping
+  }
+  js.wake.notify_one();
+}
 
-	//************
-	//Draw model #1 the second time
-	//This model is stored in the VBO starting a offest model1_start and with model1_numVerts num. of verticies
-	//*************
+//Split the top half off for others until no more than grain items are left, then run those
+static void runJob(JobSystem& js, Job job, int self){
+  while (job.end - job.begin > job.grain){
+    Job half = job;
+    half.begin = job.begin + (job.end - job.begin)/2;
+    job.end = half.begin;
+    (*job.pending)++;
+    pushJob(js, self, half);
+  }
+  job.run(job.data, job.begin, job.end, self);
+  (*job.pending)--;
+}
 
-	//Translate the model (matrix) left and back
-	model = glm::mat4(1); //Load intentity
-	model = glm::translate(model,glm::vec3(-2,-1,-.4));
-	//model = glm::scale(model,2.f*glm::vec3(1.f,1.f,0.5f)); //scale example
-	glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
+static void jobWorker(JobSystem* js, int self){
+  while (true){
+    Job job;
+    if (takeJob(*js, self, job)){
+      runJob(*js, job, self);
+      continue;
+    }
+    unique_lock<mutex> lock(js->sleepLock);
+    while (!js->quit && js->queued == 0) js->wake.wait(lock);
+    if (js->quit) return;
+  }
+}
 
-	//Set which texture to use (0 = wood texture ... bound to GL_TEXTURE0)
-	glUniform1i(uniTexID, 0);
+void startJobSystem(JobSystem& js, int numThreads){
+  js.numThreads = max(1, numThreads);
+  js.queues = new JobQueue[js.numThreads];
+  js.queued = 0;
+  js.quit = false;
+  for (int t = 1; t < js.numThreads; t++) js.workers.push_back(thread(jobWorker, &js, t));
+  drawLists.resize(js.numThreads);
+}
 
-  //Draw an instance of the model (at the position & orientation specified by the model matrix above)
-	//glDrawArrays(GL_TRIANGLES, model1_start, model1_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
+void stopJobSystem(JobSystem& js){
+  {
+    lock_guard<mutex> lock(js.sleepLock);
+    js.quit = true;
+  }
+  js.wake.notify_all();
+  for (size_t w = 0; w < js.workers.size(); w++) js.workers[w].join();
+  js.workers.clear();
+  delete[] js.queues;
+  js.queues = NULL;
+  js.numThreads = 0;
+  for (size_t t = 0; t < drawLists.size(); t++){
+    resetArena(drawLists[t].arena);
+    free(drawLists[t].arena.memory);
+  }
+  drawLists.clear();
+}
 
+//Run run(data, begin, end, thread) over [0, count) on all the threads, in pieces of no more
+//than grain, and return when every piece is done. Only from the GL thread.
+void parallelFor(JobSystem& js, int count, int grain, JobFunction run, void* data){
+  if (count <= 0) return;
+  if (js.numThreads <= 1){
+    run(data, 0, count, 0);
+    return;
+  }
+  std::atomic<int> pending(1);
+  Job job = {run, data, 0, count, max(1, grain), &pending};
+  runJob(js, job, 0);
+  while (pending > 0){ //Help out until the stragglers are done
+    if (takeJob(js, 0, job)) runJob(js, job, 0);
+    else std::this_thread::yield();
+  }
+}
 
-  //Draw an instance of the model (at the position & orientation specified by the model matrix above)
-//  glDrawArrays(GL_TRIANGLES, square_start,square_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
+void* arenaAlloc(FrameArena& arena, size_t bytes){
+  bytes = (bytes + 15) & ~(size_t)15;
+  arena.used += bytes;
+  if (arena.used <= arena.capacity) return arena.memory + arena.used - bytes;
+  void* memory = malloc(bytes); //Didn't fit this frame, the arena will be big enough next frame
+  arena.overflow.push_back(memory);
+  return memory;
+}
 
-  //************
-	//Draw model #4 once
-	//This model is stored in the VBO starting a offest model2_start and with model2_numVerts num of verticies
-	//*************
+void resetArena(FrameArena& arena){
+  for (size_t i = 0; i < arena.overflow.size(); i++) free(arena.overflow[i]);
+  arena.overflow.clear();
+  if (arena.used > arena.capacity){
+    free(arena.memory);
+    arena.capacity = arena.used + arena.used/2;
+    arena.memory = (char*)malloc(arena.capacity);
+  }
+  arena.used = 0;
+}
 
-	//Translate the model (matrix) based on where objx/y/z is
-	// ... these variables are set when the user presses the arrow keys
-	/*model = glm::mat4(1);
-	model = glm::scale(model,glm::vec3(.2f,.2f,.2f)); //scale this model
-	model = glm::translate(model,glm::vec3(-1,-0.5,-1.4));
+//Empty every thread's draw list, first thing in the traversal each frame
+void resetDrawLists(){
+  if (drawLists.empty()) drawLists.resize(1); //No job system, everything runs on the GL thread
+  for (size_t t = 0; t < drawLists.size(); t++){
+    DrawList& list = drawLists[t];
+    resetArena(list.arena);
+    list.props = NULL;
+    list.chunks = NULL;
+    list.cull = CullStats();
+    list.lights.clear();
+  }
+}
 
-	//Set which texture to use (1 = brick texture ... bound to GL_TEXTURE1)
+static void emitChunk(DrawList& list, int chunk){
+  if (list.chunks == NULL || list.chunks->count == CHUNK_BLOCK){
+    ChunkBlock* block = (ChunkBlock*)arenaAlloc(list.arena, sizeof(ChunkBlock));
+    block->next = list.chunks;
+    block->count = 0;
+    list.chunks = block;
+  }
+  list.chunks->chunk[list.chunks->count++] = chunk;
+}
 
-	glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-  glUniform1i(uniTexID, 2);
-	//Draw an instance of the model (at the position & orientation specified by the model matrix above)
-	glDrawArrays(GL_TRIANGLES, sphere_start, sphere_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-*/
-  model = glm::mat4(1); //Load intentity
-  model = glm::rotate(model,6.3f,glm::vec3(0.0f, 1.0f, 1.0f));
-  model = glm::scale(model,glm::vec3(.5f,.4f,.2f)); //scale this model
-  model = glm::translate(model,glm::vec3(-.5,-1.5,-1));
-  glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-  glUniform1i(uniTexID, 2);
-  //Draw an instance of the model (at the position & orientation specified by the model matrix above)
-//  glDrawArrays(GL_TRIANGLES, square_start,square_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-    //************
-  	//Draw sqauare
-  	//This model is stored in the VBO starting a offest square_start and with square_numVerts num of verticies
-  	//*************
+static void emitProp(DrawList& list, int model, int lod, const ObjectTransform& transform, int texID){
+  if (list.props == NULL || list.props->count == PROP_BLOCK){
+    PropBlock* block = (PropBlock*)arenaAlloc(list.arena, sizeof(PropBlock));
+    block->next = list.props;
+    block->count = 0;
+    list.props = block;
+  }
+  PropBlock* block = list.props;
+  block->model[block->count] = model;
+  block->lod[block->count] = lod;
+  block->gpu[block->count].transform = transform;
+  block->gpu[block->count].texID = texID;
+  block->count++;
+}
 
-    int t = 0;
+//// Render Queue ///////
 
-    for(int i = 0; i<mapArray[0];i++){
-      for(int j = 0; j<mapArray[0]; j++){
+//Sort key, most significant first: program, texture, mesh, then depth (front to back) among
+//draws that share all three. depth is 0..1 of the way to the far plane.
+unsigned long long renderKey(GLuint program, GLuint texture, int mesh, float depth){
+  unsigned long long d = (unsigned long long)(glm::clamp(depth, 0.f, 1.f) * 0xFFFFFF);
+  return (unsigned long long)(program & 0xFFF) << 52 | (unsigned long long)(texture & 0xFFF) << 40 |
+         (unsigned long long)(mesh & 0xFFFF) << 24 | d;
+}
 
-    	//Translate the model (matrix) based on where objx/y/z is
-    	// ... these variables are set when the user presses the arrow keys
-      model = glm::mat4(1); //Load intentity
-      model = glm::translate(model,glm::vec3(-2,j,i));
-      //model = glm::scale(model,glm::vec3(.4f,.4f,.4f)); //scale this model
+void queueDraw(RenderQueue& queue, unsigned long long key, const RenderCommand& command){
+  RenderSortItem item = {key, (unsigned int)queue.commands.size()};
+  queue.items.push_back(item);
+  queue.commands.push_back(command);
+}
 
+//LSD radix sort on the keys, a byte at a time. Bytes that are the same in every key (most of
+//them, with only a few programs and meshes) are skipped.
+void sortRenderQueue(RenderQueue& queue){
+  size_t n = queue.items.size();
+  queue.scratch.resize(n);
+  RenderSortItem* from = queue.items.data();
+  RenderSortItem* to = queue.scratch.data();
+  for (int shift = 0; shift < 64; shift += 8){
+    size_t count[256] = {0};
+    for (size_t i = 0; i < n; i++) count[(from[i].key >> shift) & 0xFF]++;
+    if (count[(from[0].key >> shift) & 0xFF] == n) continue;
+    size_t start = 0;
+    for (int b = 0; b < 256; b++){
+      size_t c = count[b];
+      count[b] = start;
+      start += c;
+    }
+    for (size_t i = 0; i < n; i++) to[count[(from[i].key >> shift) & 0xFF]++] = from[i];
+    swap(from, to);
+  }
+  if (from != queue.items.data()) memcpy(queue.items.data(), from, n*sizeof(RenderSortItem));
+}
 
-    	//Set which texture to use (1 = brick texture ... bound to GL_TEXTURE1)
-    	//glUniform1i(uniTexID, 1);
+//Draw everything queued this frame in key order, then empty the queue
+void submitRenderQueue(RenderQueue& queue, GLStateCache& cache){
+  if (!queue.items.empty()) sortRenderQueue(queue);
+  for (size_t i = 0; i < queue.items.size(); i++){
+    const RenderCommand& draw = queue.commands[queue.items[i].index];
+    bindProgram(cache, draw.program);
+    bindVertexArray(cache, draw.vao);
+    bindMaterials(cache, draw.texture);
+    if (draw.kind == DRAW_MULTI){
+      glMultiDrawElements(GL_TRIANGLES, &queue.multiCounts[draw.first], GL_UNSIGNED_INT, &queue.multiOffsets[draw.first], draw.count);
+    }
+    else {
+      bindPropInstances(cache, draw.instanceBase);
+      glDrawElementsInstancedBaseVertex(GL_TRIANGLES, draw.count, GL_UNSIGNED_INT,
+                                        (void*)(draw.first*sizeof(unsigned int)), draw.instances, draw.baseVertex);
+    }
+    renderStats.drawCalls++;
+  }
+  queue.items.clear();
+  queue.commands.clear();
+  queue.multiCounts.clear();
+  queue.multiOffsets.clear();
+}
 
-      glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-      glUniform1i(uniTexID, 0);
-    	//Draw an instance of the model (at the position & orientation specified by the model matrix above)
-    	glDrawArrays(GL_TRIANGLES, square_start,square_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-      //DRAW WALLS
-      //cout<<map[i][j]<<endl;
+//The GL state the draws above need, set only when it isn't already. Both counts go in
+//renderStats: stateRequests for every call, stateChanges for the ones that reach GL.
+void forgetGLState(GLStateCache& cache){
+  cache.program = cache.vao = cache.texture = GL_STATE_UNKNOWN;
+  cache.propInstanceBase = (size_t)-1;
+}
 
+void bindProgram(GLStateCache& cache, GLuint program){
+  renderStats.stateRequests++;
+  if (cache.program == program) return;
+  glUseProgram(program);
+  cache.program = program;
+  renderStats.stateChanges++;
+}
 
-      //DRAW WALL
-      if(map[i][j]==2 ){
+void bindVertexArray(GLStateCache& cache, GLuint vao){
+  renderStats.stateRequests++;
+  if (cache.vao == vao) return;
+  glBindVertexArray(vao);
+  cache.vao = vao;
+  renderStats.stateChanges++;
+}
 
+void bindMaterials(GLStateCache& cache, GLuint texture){
+  renderStats.stateRequests++;
+  if (cache.texture == texture) return;
+  glActiveTexture(GL_TEXTURE0 + MATERIAL_UNIT);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+  cache.texture = texture;
+  renderStats.stateChanges++;
+}
 
-        model = glm::mat4(1); //Load intentity
-        model = glm::translate(model,glm::vec3(-1,j,i));
-        //model = glm::scale(model,glm::vec3(.4f,.4f,.4f)); //scale this model
+//No base instance in GL 3.3, so each prop model's draw points the instance attributes at its
+//slice of propInstanceVbo. Expects propVao to be bound.
+void bindPropInstances(GLStateCache& cache, size_t base){
+  renderStats.stateRequests++;
+  if (cache.propInstanceBase == base) return;
+  glBindBuffer(GL_ARRAY_BUFFER, propInstanceVbo);
+  for (int col = 0; col < 4; col++){
+    glVertexAttribPointer(propMvpAttrib + col, 4, GL_FLOAT, GL_FALSE, sizeof(PropGPU), (void*)(base + offsetof(PropGPU, transform.mvp) + col*sizeof(glm::vec4)));
+    if (col == 3) continue;
+    glVertexAttribPointer(propModelViewAttrib + col, 4, GL_FLOAT, GL_FALSE, sizeof(PropGPU), (void*)(base + offsetof(PropGPU, transform.modelView) + col*sizeof(glm::vec4)));
+    glVertexAttribPointer(propNormalAttrib + col, 4, GL_FLOAT, GL_FALSE, sizeof(PropGPU), (void*)(base + offsetof(PropGPU, transform.normalMatrix) + col*sizeof(glm::vec4)));
+  }
+  glVertexAttribIPointer(propTexAttrib, 1, GL_INT, sizeof(PropGPU), (void*)(base + offsetof(PropGPU, texID)));
+  cache.propInstanceBase = base;
+  renderStats.stateChanges++;
+}
 
-        objWx = -1;
-        objWy = j;
-        objWz = i;
-        //cout<<t<<endl;
+//// Transform Stage ///////
 
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-        glUniform1i(uniTexID, 1);
-        //cout<<abs(distanceTest(objWy,objWz,objy,objz))<<endl;
+//Unit quaternion (x, y, z, w) rotating angle radians about axis, like glm::rotate
+glm::vec4 axisAngle(glm::vec3 axis, float angle){
+  glm::vec3 a = glm::normalize(axis) * (float)sin(angle/2);
+  return glm::vec4(a, cos(angle/2));
+}
 
-        wallPositions[t] = glm::vec3(objWx,objWy,objWz);
+//Rotate by b, then by a
+glm::vec4 quatMul(const glm::vec4& a, const glm::vec4& b){
+  return glm::vec4(a.w*b.x + a.x*b.w + a.y*b.z - a.z*b.y,
+                   a.w*b.y - a.x*b.z + a.y*b.w + a.z*b.x,
+                   a.w*b.z + a.x*b.y - a.y*b.x + a.z*b.w,
+                   a.w*b.w - a.x*b.x - a.y*b.y - a.z*b.z);
+}
 
+void clearTransforms(TransformBatch& batch){
+  batch.px.clear(); batch.py.clear(); batch.pz.clear();
+  batch.sx.clear(); batch.sy.clear(); batch.sz.clear();
+  batch.qx.clear(); batch.qy.clear(); batch.qz.clear(); batch.qw.clear();
+}
 
-      	//Set which texture to use (1 = brick texture ... bound to GL_TEXTURE1)
-      	//glUniform1i(uniTexID, 1);
-      	//glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
+//Queue an object, returns where its result will be in batch.out
+int addTransform(TransformBatch& batch, glm::vec3 position, glm::vec3 scale, glm::vec4 rotation){
+  batch.px.push_back(position.x); batch.py.push_back(position.y); batch.pz.push_back(position.z);
+  batch.sx.push_back(scale.x); batch.sy.push_back(scale.y); batch.sz.push_back(scale.z);
+  batch.qx.push_back(rotation.x); batch.qy.push_back(rotation.y); batch.qz.push_back(rotation.z); batch.qw.push_back(rotation.w);
+  return batch.px.size()-1;
+}
 
-      	//Draw an instance of the model (at the position & orientation specified by the model matrix above)
-      	glDrawArrays(GL_TRIANGLES, square_start,square_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-        //cout<<abs(distanceTest(wallPositions[t].y,wallPositions[t].z,objy,objz))<<endl;
+//Four lanes of floats, one object per lane. SSE where we have it, plain floats otherwise.
+#ifdef TRANSFORM_SSE
+typedef __m128 float4;
+static inline float4 load4(const float* p){ return _mm_loadu_ps(p); }
+static inline void store4(float* p, float4 a){ _mm_storeu_ps(p, a); }
+static inline float4 splat4(float f){ return _mm_set1_ps(f); }
+static inline float4 add4(float4 a, float4 b){ return _mm_add_ps(a, b); }
+static inline float4 sub4(float4 a, float4 b){ return _mm_sub_ps(a, b); }
+static inline float4 mul4(float4 a, float4 b){ return _mm_mul_ps(a, b); }
+#else
+struct float4{ float v[4]; };
+static inline float4 load4(const float* p){ float4 r; for (int l = 0; l < 4; l++) r.v[l] = p[l]; return r; }
+static inline void store4(float* p, float4 a){ for (int l = 0; l < 4; l++) p[l] = a.v[l]; }
+static inline float4 splat4(float f){ float4 r; for (int l = 0; l < 4; l++) r.v[l] = f; return r; }
+static inline float4 add4(float4 a, float4 b){ for (int l = 0; l < 4; l++) a.v[l] += b.v[l]; return a; }
+static inline float4 sub4(float4 a, float4 b){ for (int l = 0; l < 4; l++) a.v[l] -= b.v[l]; return a; }
+static inline float4 mul4(float4 a, float4 b){ for (int l = 0; l < 4; l++) a.v[l] *= b.v[l]; return a; }
+#endif
 
-        t++;
+//Compute batch.out for everything queued. Matrices are column major like GL and glm:
+//m[c][r] is column c, row r.
+void runTransforms(TransformBatch& batch, const glm::mat4& view, const glm::mat4& proj){
+  int count = batch.px.size();
+  int padded = (count+3) & ~3; //Whole groups of four, the extra lanes are thrown away
+  vector<float>* inputs[10] = {&batch.px, &batch.py, &batch.pz, &batch.sx, &batch.sy, &batch.sz, &batch.qx, &batch.qy, &batch.qz, &batch.qw};
+  for (int i = 0; i < 10; i++) inputs[i]->resize(padded, 0.f);
+  batch.out.resize(padded);
+
+  float4 V[4][3], P[4][4]; //Every lane uses the same view and projection
+  for (int c = 0; c < 4; c++){
+    for (int r = 0; r < 3; r++) V[c][r] = splat4(view[c][r]);
+    for (int r = 0; r < 4; r++) P[c][r] = splat4(proj[c][r]);
+  }
+  float4 one = splat4(1.f), two = splat4(2.f);
+  for (int i = 0; i < padded; i += 4){
+    float4 x = load4(&batch.qx[i]), y = load4(&batch.qy[i]), z = load4(&batch.qz[i]), w = load4(&batch.qw[i]);
+    float4 xx = mul4(x,x), yy = mul4(y,y), zz = mul4(z,z);
+    float4 xy = mul4(x,y), xz = mul4(x,z), yz = mul4(y,z), wx = mul4(w,x), wy = mul4(w,y), wz = mul4(w,z);
+    float4 sx = load4(&batch.sx[i]), sy = load4(&batch.sy[i]), sz = load4(&batch.sz[i]);
+    //Model matrix: rotation columns times scale, then the translation
+    float4 M[4][3] = {
+      {mul4(sub4(one, mul4(two, add4(yy,zz))), sx), mul4(mul4(two, add4(xy,wz)), sx), mul4(mul4(two, sub4(xz,wy)), sx)},
+      {mul4(mul4(two, sub4(xy,wz)), sy), mul4(sub4(one, mul4(two, add4(xx,zz))), sy), mul4(mul4(two, add4(yz,wx)), sy)},
+      {mul4(mul4(two, add4(xz,wy)), sz), mul4(mul4(two, sub4(yz,wx)), sz), mul4(sub4(one, mul4(two, add4(xx,yy))), sz)},
+      {load4(&batch.px[i]), load4(&batch.py[i]), load4(&batch.pz[i])}};
+    //Model-view (the bottom row stays 0 0 0 1)
+    float4 MV[4][3];
+    for (int c = 0; c < 4; c++){
+      for (int r = 0; r < 3; r++){
+        MV[c][r] = add4(add4(mul4(V[0][r], M[c][0]), mul4(V[1][r], M[c][1])), mul4(V[2][r], M[c][2]));
+        if (c == 3) MV[c][r] = add4(MV[c][r], V[3][r]);
       }
-      //DRAW DOOR
-      if(map[i][j]==3 ){
-
-        model = glm::mat4(1); //Load intentity
-        //model = glm::scale(model,glm::vec3(.4f,.4f,.4f)); //scale this model
-      	model = glm::translate(model,glm::vec3(-1,j,i));
-        doory = j;
-        doorz = i;
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-        glUniform1i(uniTexID, whichKey);
-        if(collideDoor == true && collideKey  == true){
-
-        }else{
-        //Draw an instance of the model (at the position & orientation specified by the model matrix above)
-        glDrawArrays(GL_TRIANGLES, square_start,square_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
+    }
+    //Model-view-projection
+    float4 MVP[4][4];
+    for (int c = 0; c < 4; c++){
+      for (int r = 0; r < 4; r++){
+        MVP[c][r] = add4(add4(mul4(P[0][r], MV[c][0]), mul4(P[1][r], MV[c][1])), mul4(P[2][r], MV[c][2]));
+        if (c == 3) MVP[c][r] = add4(MVP[c][r], P[3][r]);
       }
+    }
+    //Normals take the inverse transpose of the model-view, up to scale (the shaders normalize).
+    //That is the cofactor matrix, whose columns are cross products of the model-view's columns.
+    float4 N[3][3];
+    for (int c = 0; c < 3; c++){
+      const float4* a = MV[(c+1)%3];
+      const float4* b = MV[(c+2)%3];
+      N[c][0] = sub4(mul4(a[1], b[2]), mul4(a[2], b[1]));
+      N[c][1] = sub4(mul4(a[2], b[0]), mul4(a[0], b[2]));
+      N[c][2] = sub4(mul4(a[0], b[1]), mul4(a[1], b[0]));
+    }
+
+    //Back to one struct per object
+    float lanes[4];
+    for (int c = 0; c < 4; c++){
+      for (int r = 0; r < 4; r++){
+        store4(lanes, MVP[c][r]);
+        for (int l = 0; l < 4; l++) batch.out[i+l].mvp[c][r] = lanes[l];
+        if (r == 3) continue;
+        store4(lanes, MV[c][r]);
+        for (int l = 0; l < 4; l++) batch.out[i+l].modelView[r][c] = lanes[l];
+        if (c == 3) continue;
+        store4(lanes, N[c][r]);
+        for (int l = 0; l < 4; l++) batch.out[i+l].normalMatrix[c][r] = lanes[l];
       }
-      //DRAW US
-     if(map[i][j] == 4){
-        //************
-        //Draw model #2 once
-        //This model is stored in the VBO starting a offest model2_start and with model2_numVerts num of verticies
-        //*************
+    }
+  }
+  for (int i = 0; i < 10; i++) inputs[i]->resize(count);
+  batch.out.resize(count);
+}
 
-        //Translate the model (matrix) based on where objx/y/z is
-        // ... these variables are set when the user presses the arrow keys
-        model = glm::mat4(1);
+//// Simulation ///////
+
+//Advance the game by one tick of TICK_SECONDS, with the arrow keys as they are held right now.
+//The knot moves at a steady rate while a key is down (about what key repeat used to give).
+void simTick(const Uint8* keys){
+  EntityStore& es = entities;
+  int n = es.count();
+  //Remember where everything was, for drawing between ticks
+  if (n > 0){
+    memcpy(es.prevCol.data(), es.col.data(), n*sizeof(float));
+    memcpy(es.prevRow.data(), es.row.data(), n*sizeof(float));
+    memcpy(es.prevHeight.data(), es.height.data(), n*sizeof(float));
+  }
+  int p = es.player;
+  if (p >= 0){
+    float step = velocity * 0.9f * TICK_SECONDS;
+    bool shift = keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT];
+    if (keys[SDL_SCANCODE_UP]){
+      facing = glm::vec2(0,1);
+      if (shift) es.height[p] += step; //Shift moves in/out of the screen
+      else es.moveRow[p] += step;
+    }
+    if (keys[SDL_SCANCODE_DOWN]){
+      facing = glm::vec2(0,-1);
+      if (shift) es.height[p] -= step;
+      else es.moveRow[p] -= step;
+    }
+    if (keys[SDL_SCANCODE_LEFT]){
+      facing = glm::vec2(-1,0);
+      es.moveCol[p] -= step;
+    }
+    if (keys[SDL_SCANCODE_RIGHT]){
+      facing = glm::vec2(1,0);
+      es.moveCol[p] += step;
+    }
+  }
+  steerAgents(es, nav);
+  moveEntities(es);
+  triggerEntities(es);
+  updateNavigation(nav, es); //Goals that moved and doors that opened
+}
 
-        model = glm::translate(model,glm::vec3(-1,j+objy,i+objz));
-        model = glm::scale(model,glm::vec3(.3f,.3f,.3f)); //scale this model
+//Drawing happens alpha of the way from the previous tick to the current one
+void interpolateSim(float alpha){
+  simAlpha = alpha;
+}
 
-        //Set which texture to use (1 = brick texture ... bound to GL_TEXTURE1)
+void setFramePacing(int pacing){
+  framePacing = pacing;
+  int interval = pacing == PACE_VSYNC ? 1 : pacing == PACE_ADAPTIVE ? -1 : 0;
+  if (SDL_GL_SetSwapInterval(interval) != 0 && pacing == PACE_ADAPTIVE){
+    printf("Adaptive vsync not supported, using vsync\n");
+    framePacing = PACE_VSYNC;
+    SDL_GL_SetSwapInterval(1);
+  }
+  printf("Frame pacing: %s\n", pacingNames[framePacing]);
+}
 
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-        glUniform1i(uniTexID, 1);
+//// Frame Capture ///////
 
-        //Draw an instance of the model (at the position & orientation specified by the model matrix above)
-        glDrawArrays(GL_TRIANGLES, model2_start, model2_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-        if(distanceTest(j+objy,i+objz,keyy,keyz)<=0.1){
-         collideKey = true;
+void captureWriter(FrameCapture* cap);
 
-        }
-        if(distanceTest(j+objy,i+objz,doory,doorz)<=0.1){
-         collideDoor = true;
+void startCapture(FrameCapture& cap, int width, int height){
+  cap.width = width;
+  cap.height = height;
+  glGenBuffers(CAPTURE_RING, cap.pbos);
+  for (int i = 0; i < CAPTURE_RING; i++){
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, cap.pbos[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)width*height*4, NULL, GL_STREAM_READ);
+    cap.fences[i] = 0;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (!cap.prefix) cap.prefix = "frame";
+  if (cap.pipeCommand){
+    cap.pipe = popen(cap.pipeCommand, "w");
+    if (!cap.pipe){
+      printf("ERROR: Couldn't start '%s', not recording\n", cap.pipeCommand);
+      cap.recording = false;
+    }
+  }
+  cap.quit = false;
+  cap.writer = thread(captureWriter, &cap);
+}
 
-        }
+//Hand the oldest slot's pixels to the writer. Its fence is waited on only if it hasn't
+//signalled yet, which after CAPTURE_RING-1 frames it almost always has.
+void retireCaptureSlot(FrameCapture& cap, int slot){
+  glClientWaitSync(cap.fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+  glDeleteSync(cap.fences[slot]);
+  cap.fences[slot] = 0;
+  bool screenshot = cap.slotScreenshot[slot];
+  unique_lock<mutex> guard(cap.lock);
+  if ((int)cap.queue.size() >= CAPTURE_MAX_QUEUED && !screenshot){ //The writer can't keep up, don't stall the game for it
+    cap.dropped++;
+    return;
+  }
+  CapturedFrame frame;
+  if (!cap.spare.empty()){
+    frame.rgba.swap(cap.spare.back());
+    cap.spare.pop_back();
+  }
+  guard.unlock();
+  size_t bytes = (size_t)cap.width*cap.height*4;
+  frame.rgba.resize(bytes);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, cap.pbos[slot]);
+  void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+  if (pixels) memcpy(frame.rgba.data(), pixels, bytes);
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  frame.number = cap.slotRecorded[slot] ? cap.frames++ : -1;
+  frame.screenshot = screenshot ? cap.screenshots++ : -1;
+  guard.lock();
+  cap.queue.push_back(std::move(frame));
+  cap.wake.notify_one();
+}
 
+//Start reading back the frame just drawn (from the bound framebuffer) if we are recording or a
+//screenshot was asked for, and pass on any earlier frame whose copy has finished
+void captureFrame(FrameCapture& cap){
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (int i = 0; i < CAPTURE_RING; i++){ //Done copying?
+    int slot = (cap.next + i) % CAPTURE_RING;
+    if (cap.fences[slot] && glClientWaitSync(cap.fences[slot], 0, 0) != GL_TIMEOUT_EXPIRED) retireCaptureSlot(cap, slot);
+  }
+  if (cap.recording || cap.screenshotPending){
+    int slot = cap.next;
+    if (cap.fences[slot]) retireCaptureSlot(cap, slot); //The ring is full, the oldest has to go now
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, cap.pbos[slot]);
+    glReadPixels(0, 0, cap.width, cap.height, GL_RGBA, GL_UNSIGNED_BYTE, 0); //Into the buffer, returns right away
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    cap.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    cap.slotRecorded[slot] = cap.recording;
+    cap.slotScreenshot[slot] = cap.screenshotPending;
+    cap.screenshotPending = false;
+    cap.next = (slot+1) % CAPTURE_RING;
+    cap.readbackMs += elapsedMs(start);
+    cap.readbacks++;
+  }
+}
 
-      }
-      //  camPosX = -0.4;
+bool writePPM(const char* fileName, int width, int height, const vector<unsigned char>& rgb){
+  FILE* f = fopen(fileName, "wb");
+  if (!f){
+    printf("ERROR: Couldn't write %s\n", fileName);
+    return false;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  fwrite(rgb.data(), 1, rgb.size(), f);
+  fclose(f);
+  return true;
+}
 
+//Flip to top row first, drop alpha and save (or pipe) the frame. Runs on the writer thread.
+void writeCapturedFrame(FrameCapture& cap, const CapturedFrame& frame, vector<unsigned char>& rgb){
+  rgb.resize((size_t)cap.width*cap.height*3);
+  for (int y = 0; y < cap.height; y++){
+    const unsigned char* src = &frame.rgba[(size_t)(cap.height-1-y)*cap.width*4];
+    unsigned char* dst = &rgb[(size_t)y*cap.width*3];
+    for (int x = 0; x < cap.width; x++){
+      dst[x*3+0] = src[x*4+0];
+      dst[x*3+1] = src[x*4+1];
+      dst[x*3+2] = src[x*4+2];
+    }
+  }
+  char fileName[512];
+  if (frame.number >= 0){
+    if (cap.pipe) fwrite(rgb.data(), 1, rgb.size(), cap.pipe);
+    else {
+      snprintf(fileName, sizeof(fileName), "%s%05d.ppm", cap.prefix, frame.number);
+      writePPM(fileName, cap.width, cap.height, rgb);
+    }
+  }
+  if (frame.screenshot >= 0){
+    snprintf(fileName, sizeof(fileName), "screenshot%03d.ppm", frame.screenshot);
+    if (writePPM(fileName, cap.width, cap.height, rgb)) printf("Saved %s\n", fileName);
+  }
+}
 
+void captureWriter(FrameCapture* cap){
+  vector<unsigned char> rgb;
+  unique_lock<mutex> guard(cap->lock);
+  while (true){
+    cap->wake.wait(guard, [cap]{ return cap->quit || !cap->queue.empty(); });
+    if (cap->queue.empty()) return; //Only quit once everything is written
+    CapturedFrame frame = std::move(cap->queue.front());
+    cap->queue.pop_front();
+    guard.unlock();
+    writeCapturedFrame(*cap, frame, rgb);
+    guard.lock();
+    cap->spare.push_back(std::move(frame.rgba));
+  }
+}
 
+//Write out whatever is still in flight, then shut the writer down
+void stopCapture(FrameCapture& cap){
+  for (int i = 0; i < CAPTURE_RING; i++){
+    int slot = (cap.next + i) % CAPTURE_RING;
+    if (cap.fences[slot]) retireCaptureSlot(cap, slot);
+  }
+  {
+    lock_guard<mutex> guard(cap.lock);
+    cap.quit = true;
+  }
+  cap.wake.notify_one();
+  if (cap.writer.joinable()) cap.writer.join();
+  if (cap.pipe) pclose(cap.pipe);
+  cap.pipe = NULL;
+  glDeleteBuffers(CAPTURE_RING, cap.pbos);
+  if (cap.frames > 0 || cap.dropped > 0){
+    printf("Recorded %d frames (%d dropped), capture took %.3f ms per frame\n", cap.frames, cap.dropped,
+           cap.readbacks ? cap.readbackMs/cap.readbacks : 0.0);
+  }
+}
 
+//Screenshot of the next frame, saved as screenshotNNN.ppm without stalling for it
+void Win2PPM(int width, int height){
+  if (width != capture.width || height != capture.height){
+    printf("ERROR: Screenshots are %dx%d, not %dx%d\n", capture.width, capture.height, width, height);
+    return;
+  }
+  capture.screenshotPending = true;
+}
 
-      //DRAW KEY
-      if(map[i][j]==5 || map[i][j]==6 ){
+//// Profiler ///////
 
-        model = glm::mat4(1); //Load intentity
-        model = glm::translate(model,glm::vec3(-1,j,i));
-        model = glm::scale(model,glm::vec3(.4f,.4f,.4f)); //scale this model*/
-      //  glm::mat4 model = glm::mat4(1);
-      	model = glm::rotate(model,timePast * 3.14f/2,glm::vec3(0.0f, 1.0f, 1.0f));
-      	model = glm::rotate(model,timePast * 3.14f/4,glm::vec3(1.0f, 0.0f, 0.0f));
-      	//model = glm::scale(model,glm::vec3(.2f,.2f,.2f)); //An example of scale
-      	GLint uniModel = glGetUniformLocation(shaderProgram, "model");
-      	glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model)); //pass model matrix to shader
+double profileNowMs(){
+  return (SDL_GetPerformanceCounter()-profiler.origin)*1000.0/SDL_GetPerformanceFrequency();
+}
 
-        if(map[i][j]==5){
-          whichKey = 2;
-        }
-        if(map[i][j]==6){
-          whichKey = 3;
-        }
-        //Set which texture to use (1 = brick texture ... bound to GL_TEXTURE1)
-        keyx = -1;
-        keyy = j;
-        keyz = i;
-        if(collideKey == false){
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
-        glUniform1i(uniTexID, whichKey);
-        //Draw an instance of the model (at the position & orientation specified by the model matrix above)
-        //glDrawArrays(GL_TRIANGLES, sphere_start, sphere_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-        glDrawArrays(GL_TRIANGLES, model1_start, model1_numVerts); //(Primitive Type, Start Vertex, Num Verticies)
-        }
+void startProfiler(Profiler& prof){
+  prof.origin = SDL_GetPerformanceCounter();
+  GLint64 gpuNow;
+  glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+  prof.gpuOffsetMs = profileNowMs() - gpuNow/1e6;
+  prof.frameNumber = -1;
+  loadShaderProgram(prof.overlayShader, "overlay-Vertex.glsl", "overlay-Fragment.glsl");
+  glGenVertexArrays(1, &prof.overlayVao);
+  glBindVertexArray(prof.overlayVao);
+  glGenBuffers(1, &prof.overlayVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, prof.overlayVbo);
+  GLint posAttrib = prof.overlayShader.attrib("position");
+  glVertexAttribPointer(posAttrib, 2, GL_FLOAT, GL_FALSE, 6*sizeof(float), 0);
+  glEnableVertexAttribArray(posAttrib);
+  GLint colAttrib = prof.overlayShader.attrib("inColor");
+  glVertexAttribPointer(colAttrib, 4, GL_FLOAT, GL_FALSE, 6*sizeof(float), (void*)(2*sizeof(float)));
+  glEnableVertexAttribArray(colAttrib);
+  glBindVertexArray(0);
+  if (prof.traceFile) startTrace(prof, prof.traceFile, prof.traceFrames);
+}
 
-        velocity = 2.0;
+ProfileScope::ProfileScope(const char* name, bool gpu){
+  cpuZone = gpuZone = -1;
+  if (profiler.frameNumber < 0) return; //Not started
+  frame = &profiler.frames[profiler.frameNumber % PROFILE_LAG];
+  ProfileZone zone = {name, profileNowMs(), -1, profiler.depth++, false, {0, 0}};
+  cpuZone = frame->zones.size();
+  frame->zones.push_back(zone);
+  if (gpu){
+    zone.gpu = true;
+    zone.depth = profiler.gpuDepth++;
+    for (int q = 0; q < 2; q++){
+      if (profiler.spareQueries.empty()) glGenQueries(1, &zone.queries[q]);
+      else {
+        zone.queries[q] = profiler.spareQueries.back();
+        profiler.spareQueries.pop_back();
       }
+    }
+    glQueryCounter(zone.queries[0], GL_TIMESTAMP);
+    gpuZone = frame->zones.size();
+    frame->zones.push_back(zone);
+  }
+}
 
+void ProfileScope::end(){
+  if (cpuZone < 0) return;
+  frame->zones[cpuZone].endMs = profileNowMs();
+  profiler.depth--;
+  if (gpuZone >= 0){
+    glQueryCounter(frame->zones[gpuZone].queries[1], GL_TIMESTAMP);
+    profiler.gpuDepth--;
   }
+  cpuZone = gpuZone = -1;
+}
 
+//One frame's zones as complete ("X") events on a CPU and a GPU track, plus its counters
+void writeTraceFrame(Profiler& prof, const ProfileFrame& frame){
+  for (size_t z = 0; z < frame.zones.size(); z++){
+    const ProfileZone& zone = frame.zones[z];
+    fprintf(prof.trace, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%lld}}",
+            zone.name, zone.gpu ? "gpu" : "cpu", zone.startMs*1000, (zone.endMs-zone.startMs)*1000, zone.gpu ? 2 : 1, frame.number);
+  }
+  if (frame.zones.empty()) return;
+  fprintf(prof.trace, ",\n{\"name\":\"Render\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"drawCalls\":%lld,\"stateChanges\":%lld,\"stateRequests\":%lld,\"triangles\":%lld,\"vertices\":%lld,\"lights\":%lld}}",
+          frame.zones[0].startMs*1000, frame.stats.drawCalls, frame.stats.stateChanges, frame.stats.stateRequests, frame.stats.triangles, frame.stats.vertices,
+          frame.stats.lights);
+  if (prof.traceFrames > 0 && --prof.traceFrames == 0) stopTrace(prof);
 }
 
+//Read back a frame's GPU times (PROFILE_LAG frames on they are almost always ready) and pass it on
+void finishProfileFrame(Profiler& prof, ProfileFrame& frame){
+  float cpuMs = 0, gpuMs = 0;
+  for (size_t z = 0; z < frame.zones.size(); z++){
+    ProfileZone& zone = frame.zones[z];
+    if (zone.gpu){
+      GLuint64 start, end;
+      glGetQueryObjectui64v(zone.queries[0], GL_QUERY_RESULT, &start);
+      glGetQueryObjectui64v(zone.queries[1], GL_QUERY_RESULT, &end);
+      prof.spareQueries.push_back(zone.queries[0]);
+      prof.spareQueries.push_back(zone.queries[1]);
+      zone.startMs = start/1e6 + prof.gpuOffsetMs;
+      zone.endMs = end/1e6 + prof.gpuOffsetMs;
+    }
+    if (zone.endMs < zone.startMs) zone.endMs = zone.startMs; //Still open when we stopped
+    if (zone.depth == 0) (zone.gpu ? gpuMs : cpuMs) += zone.endMs - zone.startMs;
+  }
+  memmove(prof.cpuHistory, prof.cpuHistory+1, (PROFILE_HISTORY-1)*sizeof(float));
+  memmove(prof.gpuHistory, prof.gpuHistory+1, (PROFILE_HISTORY-1)*sizeof(float));
+  prof.cpuHistory[PROFILE_HISTORY-1] = cpuMs;
+  prof.gpuHistory[PROFILE_HISTORY-1] = gpuMs;
+  if (prof.trace) writeTraceFrame(prof, frame);
+  prof.last.number = frame.number;
+  prof.last.stats = frame.stats;
+  prof.last.zones.swap(frame.zones);
+  frame.zones.clear();
 }
-bool isWalkable(float x, float y){
 
-      //cout<<" "<<map[(int)ceil(y+4)][(int)ceil(x)]<<endl;
-      cout<<" "<<(int)ceil(y+4)<<(int)ceil(x)<<endl;
-      //cout<<map[3][1]<<endl;
-      if(collideKey == true){
-        return true;
-      }
-      if(x<-0.2 || y< -4.5 || x>4.3 || y>0.2){
-        return false;
-      }
+//Call first thing in a frame, before any ProfileScope
+void profileBeginFrame(Profiler& prof){
+  if (prof.frameNumber >= 0) prof.frames[prof.frameNumber % PROFILE_LAG].stats = renderStats; //The frame just drawn
+  prof.frameNumber++;
+  ProfileFrame& frame = prof.frames[prof.frameNumber % PROFILE_LAG];
+  if (!frame.zones.empty()) finishProfileFrame(prof, frame);
+  frame.number = prof.frameNumber;
+  frame.stats = RenderStats();
+}
 
-      if(map[(int)ceil(y+4)][(int)ceil(x)]==3 || map[(int)ceil(y+4)][(int)ceil(x)]==2){
-        return false;
+void overlayQuad(vector<float>& verts, float x0, float y0, float x1, float y1, glm::vec4 color){
+  const float corners[6][2] = {{x0,y0}, {x1,y0}, {x1,y1}, {x0,y0}, {x1,y1}, {x0,y1}};
+  for (int v = 0; v < 6; v++){
+    float vert[6] = {corners[v][0], corners[v][1], color.x, color.y, color.z, color.w};
+    verts.insert(verts.end(), vert, vert+6);
+  }
+}
 
-      }
-      if(map[(int)floor(y+4)][(int)floor(x)]==3 || map[(int)floor(y+4)][(int)floor(x)]==2){
-        return false;
+//Zones keep the same color from frame to frame
+glm::vec4 zoneColor(const char* name){
+  static const glm::vec4 palette[8] = {glm::vec4(.9f,.3f,.3f,1), glm::vec4(.3f,.8f,.3f,1), glm::vec4(.3f,.5f,.95f,1), glm::vec4(.95f,.8f,.2f,1),
+                                       glm::vec4(.8f,.4f,.9f,1), glm::vec4(.2f,.85f,.85f,1), glm::vec4(.95f,.55f,.2f,1), glm::vec4(.7f,.7f,.7f,1)};
+  unsigned int hash = 5381;
+  for (const char* c = name; *c; c++) hash = hash*33 + *c;
+  return palette[hash % 8];
+}
 
-      }
+//The newest finished frame as a timeline (CPU zones by depth, then the GPU passes, 0 to 33 ms
+//across), and the CPU and GPU time of the last PROFILE_HISTORY frames as a graph. There's no text
+//drawing, so the numbers go in the window title.
+void drawProfilerOverlay(Profiler& prof, SDL_Window* window){
+  const float left = -.97f, width = 1.2f, top = .95f, rowHeight = .04f, msAcross = 1000/30.f;
+  static vector<float> verts;
+  verts.clear();
+  overlayQuad(verts, left-.02f, top-9*rowHeight-.33f, left+width+.02f, top+.02f, glm::vec4(0,0,0,.6f));
+  const ProfileFrame& frame = prof.last;
+  double frameStart = frame.zones.empty() ? 0 : frame.zones[0].startMs;
+  for (size_t z = 0; z < frame.zones.size(); z++){
+    const ProfileZone& zone = frame.zones[z];
+    int row = zone.gpu ? 5 + zone.depth : min(zone.depth, 4);
+    float x0 = left + width*min(1.f, (float)(zone.startMs-frameStart)/msAcross);
+    float x1 = left + width*min(1.f, (float)(zone.endMs-frameStart)/msAcross);
+    float y = top - row*rowHeight;
+    overlayQuad(verts, x0, y-rowHeight*.8f, max(x1, x0+.002f), y, zoneColor(zone.name));
+  }
+  float graphBottom = top-9*rowHeight-.3f, graphHeight = .3f, barWidth = width/PROFILE_HISTORY;
+  for (int f = 0; f < PROFILE_HISTORY; f++){
+    float x = left + f*barWidth;
+    overlayQuad(verts, x, graphBottom, x+barWidth*.9f, graphBottom + graphHeight*min(1.f, prof.cpuHistory[f]/msAcross), glm::vec4(.3f,.5f,.95f,.9f));
+    overlayQuad(verts, x+barWidth*.3f, graphBottom, x+barWidth*.6f, graphBottom + graphHeight*min(1.f, prof.gpuHistory[f]/msAcross), glm::vec4(.95f,.55f,.2f,.9f));
+  }
+  for (int line = 0; line < 2; line++){ //60 Hz budget on the timeline and on the graph
+    float x = left + width*(1000/60.f)/msAcross;
+    if (line == 0) overlayQuad(verts, x, top-9*rowHeight, x+.003f, top, glm::vec4(1,1,1,.8f));
+    else overlayQuad(verts, left, graphBottom + graphHeight*.5f, left+width, graphBottom + graphHeight*.5f + .003f, glm::vec4(1,1,1,.8f));
+  }
+
+  bindProgram(glState, prof.overlayShader.id);
+  bindVertexArray(glState, prof.overlayVao);
+  glBindBuffer(GL_ARRAY_BUFFER, prof.overlayVbo);
+  glBufferData(GL_ARRAY_BUFFER, verts.size()*sizeof(float), verts.data(), GL_STREAM_DRAW);
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glDrawArrays(GL_TRIANGLES, 0, verts.size()/6);
+  glDisable(GL_BLEND);
+  glEnable(GL_DEPTH_TEST);
+
+  if (window && SDL_GetTicks() - prof.lastTitle > 500){
+    prof.lastTitle = SDL_GetTicks();
+    char title[256];
+    snprintf(title, sizeof(title), "CPU %.2f ms, GPU %.2f ms, %lld draws, %lld state changes (of %lld), %lld triangles, %lld vertices",
+             prof.cpuHistory[PROFILE_HISTORY-1], prof.gpuHistory[PROFILE_HISTORY-1], frame.stats.drawCalls,
+             frame.stats.stateChanges, frame.stats.stateRequests, frame.stats.triangles, frame.stats.vertices);
+    SDL_SetWindowTitle(window, title);
+  }
+}
 
+bool startTrace(Profiler& prof, const char* fileName, int frames){
+  prof.trace = fopen(fileName, "w");
+  if (!prof.trace){
+    printf("ERROR: Couldn't write the trace to %s\n", fileName);
+    return false;
+  }
+  prof.traceFile = fileName;
+  prof.traceFrames = frames;
+  fprintf(prof.trace, "{\"traceEvents\":[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n"
+                      "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+  printf("Tracing to %s\n", fileName);
   return true;
 }
-// Create a NULL-terminated string by reading the provided file
-static char* readShaderSource(const char* shaderFile){
-	FILE *fp;
-	long length;
-	char *buffer;
 
-	// open the file containing the text of the shader code
+void stopTrace(Profiler& prof){
+  fprintf(prof.trace, "\n]}\n");
+  fclose(prof.trace);
+  prof.trace = NULL;
+  printf("Wrote trace %s\n", prof.traceFile);
+}
+
+void stopProfiler(Profiler& prof){
+  if (prof.frameNumber >= 0){
+    prof.frames[prof.frameNumber % PROFILE_LAG].stats = renderStats;
+    for (long long f = max(0LL, prof.frameNumber-PROFILE_LAG+1); f <= prof.frameNumber; f++){ //Oldest first
+      ProfileFrame& frame = prof.frames[f % PROFILE_LAG];
+      if (!frame.zones.empty()) finishProfileFrame(prof, frame);
+    }
+  }
+  if (prof.trace) stopTrace(prof);
+  if (!prof.spareQueries.empty()) glDeleteQueries(prof.spareQueries.size(), prof.spareQueries.data());
+  glDeleteProgram(prof.overlayShader.id);
+  glDeleteBuffers(1, &prof.overlayVbo);
+  glDeleteVertexArrays(1, &prof.overlayVao);
+}
+
+//// Headless Benchmark ///////
+
+#ifdef USE_EGL
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+
+//An OpenGL 3.3 core context with no window or surface at all (Mesa's surfaceless platform
+//works without a display or GPU, on llvmpipe). We draw into a framebuffer object instead.
+bool createHeadlessContext(GLADloadproc* loader){
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay) eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (eglDisplay == EGL_NO_DISPLAY) eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, NULL, NULL)){
+    printf("ERROR: No EGL display for headless rendering\n");
+    return false;
+  }
+  eglBindAPI(EGL_OPENGL_API);
+  const EGLint attribs[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+                            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+  eglContext = eglCreateContext(eglDisplay, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+  if (eglContext == EGL_NO_CONTEXT || !eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext)){
+    printf("ERROR: Failed to create a surfaceless OpenGL 3.3 context (0x%x)\n", eglGetError());
+    eglTerminate(eglDisplay);
+    return false;
+  }
+  *loader = (GLADloadproc)eglGetProcAddress;
+  return true;
+}
+
+void destroyHeadlessContext(){
+  eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(eglDisplay, eglContext);
+  eglTerminate(eglDisplay);
+}
+#else
+bool createHeadlessContext(GLADloadproc* loader){
+  printf("ERROR: Headless rendering needs a build with -DUSE_EGL -lEGL\n");
+  return false;
+}
+void destroyHeadlessContext(){}
+#endif
+
+//A framebuffer with color and depth renderbuffers (returned in buffers) the size of the
+//window, left bound for drawing
+GLuint createOffscreenTarget(int width, int height, GLuint buffers[2]){
+  GLuint fbo;
+  glGenFramebuffers(1, &fbo);
+  glGenRenderbuffers(2, buffers);
+  glBindRenderbuffer(GL_RENDERBUFFER, buffers[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, buffers[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, buffers[0]);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, buffers[1]);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("ERROR: Offscreen framebuffer is incomplete\n");
+  glViewport(0, 0, width, height);
+  return fbo;
+}
+
+//The scripted camera: a loop around the middle of the maze, flown low overhead for the first
+//half of the frames and walked in first person (so the PVS is used) for the second. The player
+//is moved along with it so the chunks around the camera are the ones paged in.
+void benchmarkCamera(int frame, int frames, glm::mat4& view, glm::mat4& proj){
+  float t = frame/(float)frames;
+  float angle = 2*3.14159f*(2*t); //Once around per half
+  glm::vec2 center(level.width/2.f, level.height/2.f);
+  float radius = .35f*min(level.width, level.height);
+  glm::vec2 at = center + radius*glm::vec2(cos(angle), sin(angle));     //(column, row)
+  glm::vec2 dir = glm::normalize(glm::vec2(-sin(angle), cos(angle))); //Direction of travel
+  int p = entities.player;
+  if (p >= 0){
+    entities.col[p] = entities.prevCol[p] = at.x;
+    entities.row[p] = entities.prevRow[p] = at.y;
+  }
+  facing = dir;
+  firstPerson = t >= .5f;
+  float aspect = screenWidth / (float) screenHeight;
+  if (firstPerson){
+    glm::vec3 eye(-0.8f, at.x, at.y);
+    view = glm::lookAt(eye, eye + glm::vec3(0, dir.x, dir.y), glm::vec3(1,0,0));
+    proj = glm::perspective(3.14f/3, aspect, 0.05f, 10.0f);
+  }
+  else {
+    glm::vec3 eye(2.f, at.x - 2*dir.x, at.y - 2*dir.y);
+    view = glm::lookAt(eye, glm::vec3(-2.f, at.x + 2*dir.x, at.y + 2*dir.y), glm::vec3(1,0,0));
+    proj = glm::perspective(3.14f/4, aspect, 0.5f, 20.0f);
+  }
+  updateFrameUniforms(view, proj);
+}
+
+//Frame time percentiles (nearest rank) and average draw calls/triangles per frame, as JSON
+void reportBenchmark(const char* mapFile, vector<double>& frameMs, const vector<RenderStats>& frameStats){
+  double total = 0, drawCalls = 0, triangles = 0, vertices = 0, stateChanges = 0, stateRequests = 0, lights = 0, lightEntries = 0;
+  for (size_t f = 0; f < frameMs.size(); f++){
+    total += frameMs[f];
+    drawCalls += frameStats[f].drawCalls;
+    triangles += frameStats[f].triangles;
+    vertices += frameStats[f].vertices;
+    stateChanges += frameStats[f].stateChanges;
+    stateRequests += frameStats[f].stateRequests;
+    lights += frameStats[f].lights;
+    lightEntries += frameStats[f].lightEntries;
+  }
+  int n = frameMs.size();
+  sort(frameMs.begin(), frameMs.end());
+  const double percentiles[] = {50, 90, 95, 99};
+  char json[1024];
+  int len = snprintf(json, sizeof(json),
+    "{\n  \"map\": \"%s\",\n  \"mapWidth\": %d,\n  \"mapHeight\": %d,\n  \"frames\": %d,\n  \"resolution\": [%d, %d],\n"
+    "  \"renderer\": \"%s\",\n  \"jobThreads\": %d,\n  \"frameMs\": {\"mean\": %.3f",
+    mapFile, level.width, level.height, n, screenWidth, screenHeight, (const char*)glGetString(GL_RENDERER), jobSystem.numThreads, total/n);
+  for (int p = 0; p < 4; p++){
+    int rank = max(0, min(n-1, (int)ceil(percentiles[p]/100*n)-1));
+    len += snprintf(json+len, sizeof(json)-len, ", \"p%g\": %.3f", percentiles[p], frameMs[rank]);
+  }
+  len += snprintf(json+len, sizeof(json)-len, ", \"max\": %.3f},\n  \"drawCallsPerFrame\": %.1f,\n  \"stateChangesPerFrame\": %.1f,\n"
+                  "  \"stateRequestsPerFrame\": %.1f,\n  \"trianglesPerFrame\": %.0f,\n  \"verticesPerFrame\": %.0f,\n"
+                  "  \"lightsPerFrame\": %.1f,\n  \"lightEntriesPerFrame\": %.1f\n}\n",
+                  frameMs[n-1], drawCalls/n, stateChanges/n, stateRequests/n, triangles/n, vertices/n, lights/n, lightEntries/n);
+  printf("%s", json);
+  if (benchmarkJson){
+    FILE* f = fopen(benchmarkJson, "w");
+    if (f){
+      fputs(json, f);
+      fclose(f);
+    }
+    else printf("ERROR: Couldn't write %s\n", benchmarkJson);
+  }
+}
+
+//// Binary Mesh Cache ///////
+
+double elapsedMs(Uint64 start){
+  return (SDL_GetPerformanceCounter()-start)*1000.0/SDL_GetPerformanceFrequency();
+}
+
+//Returns the file's modification time, or -1 if it doesn't exist
+static long long fileModTime(const char* fileName){
+  struct stat st;
+  if (stat(fileName, &st) != 0) return -1;
+  return (long long)st.st_mtime;
+}
+
+//"models/teapot.txt" -> "models/teapot.mesh"
+static string meshCacheName(const char* txtFileName){
+  string name = txtFileName;
+  size_t dot = name.rfind('.');
+  if (dot != string::npos) name = name.substr(0, dot);
+  return name + ".mesh";
+}
+
+//Key for welding: a vertex is a duplicate only if all of its floats match bit for bit
+struct VertexKey{
+  const float* v;
+  int stride;
+  bool operator==(const VertexKey& o) const { return memcmp(v, o.v, stride*sizeof(float)) == 0; }
+};
+struct VertexKeyHash{
+  size_t operator()(const VertexKey& k) const {
+    const unsigned char* bytes = (const unsigned char*)k.v;
+    size_t h = 2166136261u; //FNV-1a
+    for (size_t i = 0; i < k.stride*sizeof(float); i++) h = (h ^ bytes[i]) * 16777619u;
+    return h;
+  }
+};
+
+//Collapse identical vertices of a triangle soup into unique vertices + an index list
+static void weldVertices(const float* soup, int numSourceVerts, int stride, vector<float>& verts, vector<unsigned int>& indices){
+  unordered_map<VertexKey, unsigned int, VertexKeyHash> seen;
+  seen.reserve(numSourceVerts);
+  indices.resize(numSourceVerts);
+  int numUnique = 0;
+  for (int i = 0; i < numSourceVerts; i++){
+    VertexKey key = {soup + i*stride, stride};
+    unordered_map<VertexKey, unsigned int, VertexKeyHash>::iterator it = seen.find(key);
+    if (it == seen.end()){
+      it = seen.insert(make_pair(key, (unsigned int)numUnique++)).first;
+    }
+    indices[i] = it->second;
+  }
+  //Keys point into the soup, so copy the unique vertices out in index order
+  verts.resize(numUnique*stride);
+  for (int i = 0; i < numSourceVerts; i++){
+    memcpy(&verts[indices[i]*stride], soup + i*stride, stride*sizeof(float));
+  }
+}
+
+//Average cache miss ratio (transformed verts per triangle) for a FIFO post-transform cache
+static float vertexCacheACMR(const vector<unsigned int>& indices, int numVerts, int cacheSize){
+  if (indices.empty()) return 0;
+  vector<int> cachedAt(numVerts, -cacheSize-1); //Time each vertex entered the cache
+  int misses = 0;
+  for (size_t i = 0; i < indices.size(); i++){
+    unsigned int v = indices[i];
+    if (misses - cachedAt[v] > cacheSize){ //Evicted (or never loaded)
+      cachedAt[v] = misses;
+      misses++;
+    }
+  }
+  return misses/(indices.size()/3.0f);
+}
+
+//Tipsify (Sander, Nehab & Barczak 2007): reorder triangles so vertices are reused while they
+//are still in a post-transform cache of cacheSize entries. Runs in linear time.
+static void optimizeVertexCache(vector<unsigned int>& indices, int numVerts, int cacheSize){
+  int numTris = indices.size()/3;
+  if (numTris == 0) return;
+  //Vertex -> triangle adjacency (CSR layout)
+  vector<int> liveTris(numVerts, 0);
+  for (size_t i = 0; i < indices.size(); i++) liveTris[indices[i]]++;
+  vector<int> adjStart(numVerts+1, 0);
+  for (int v = 0; v < numVerts; v++) adjStart[v+1] = adjStart[v] + liveTris[v];
+  vector<int> adjFill(adjStart.begin(), adjStart.end()-1);
+  vector<int> adj(indices.size());
+  for (int t = 0; t < numTris; t++){
+    for (int k = 0; k < 3; k++) adj[adjFill[indices[3*t+k]]++] = t;
+  }
+
+  vector<int> cacheTime(numVerts, 0);
+  vector<bool> emitted(numTris, false);
+  vector<int> deadEnd; //Stack of recently used vertices to restart from
+  vector<unsigned int> out;
+  out.reserve(indices.size());
+  int fan = 0, time = cacheSize+1, cursor = 1;
+  vector<int> candidates;
+  while (fan >= 0){
+    candidates.clear();
+    for (int a = adjStart[fan]; a < adjStart[fan+1]; a++){
+      int t = adj[a];
+      if (emitted[t]) continue;
+      for (int k = 0; k < 3; k++){
+        int v = indices[3*t+k];
+        out.push_back(v);
+        deadEnd.push_back(v);
+        candidates.push_back(v);
+        liveTris[v]--;
+        if (time - cacheTime[v] > cacheSize){
+          cacheTime[v] = time;
+          time++;
+        }
+      }
+      emitted[t] = true;
+    }
+    //Next fan: the candidate that will still be in the cache after its remaining triangles are emitted
+    int best = -1, bestPriority = -1;
+    for (size_t c = 0; c < candidates.size(); c++){
+      int v = candidates[c];
+      if (liveTris[v] <= 0) continue;
+      int priority = 0;
+      if (time - cacheTime[v] + 2*liveTris[v] <= cacheSize) priority = time - cacheTime[v];
+      if (priority > bestPriority){
+        bestPriority = priority;
+        best = v;
+      }
+    }
+    if (best == -1){ //Dead end: try recently used vertices, then scan forward for any live vertex
+      while (!deadEnd.empty() && best == -1){
+        int v = deadEnd.back();
+        deadEnd.pop_back();
+        if (liveTris[v] > 0) best = v;
+      }
+      while (best == -1 && cursor < numVerts){
+        if (liveTris[cursor] > 0) best = cursor;
+        cursor++;
+      }
+    }
+    fan = best;
+  }
+  indices.swap(out);
+}
+
+//Renumber vertices in the order the index buffer first touches them, so vertex fetch is sequential too
+static void reorderVerticesByFirstUse(vector<float>& verts, vector<unsigned int>& indices, int stride){
+  int numVerts = verts.size()/stride;
+  vector<int> remap(numVerts, -1);
+  vector<float> sorted(verts.size());
+  int next = 0;
+  for (size_t i = 0; i < indices.size(); i++){
+    unsigned int v = indices[i];
+    if (remap[v] < 0){
+      remap[v] = next;
+      memcpy(&sorted[next*stride], &verts[v*stride], stride*sizeof(float));
+      next++;
+    }
+    indices[i] = remap[v];
+  }
+  sorted.resize(next*stride); //Drops any vertex no triangle uses
+  verts.swap(sorted);
+}
+
+//Quadric error metric (Garland & Heckbert 1997): the sum of squared distances from a point to
+//a set of planes, kept as the 10 unique terms of a symmetric 4x4 matrix
+struct Quadric{
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+};
+
+static void addQuadric(Quadric& q, const Quadric& o){
+  q.a2 += o.a2; q.ab += o.ab; q.ac += o.ac; q.ad += o.ad; q.b2 += o.b2;
+  q.bc += o.bc; q.bd += o.bd; q.c2 += o.c2; q.cd += o.cd; q.d2 += o.d2;
+}
+
+static double quadricError(const Quadric& q, const float* p){
+  double x = p[0], y = p[1], z = p[2];
+  double e = q.a2*x*x + 2*q.ab*x*y + 2*q.ac*x*z + 2*q.ad*x + q.b2*y*y + 2*q.bc*y*z + 2*q.bd*y
+           + q.c2*z*z + 2*q.cd*z + q.d2;
+  return e > 0 ? e : 0;
+}
+
+static glm::vec3 triangleNormal(const float* a, const float* b, const float* c){
+  glm::vec3 e1(b[0]-a[0], b[1]-a[1], b[2]-a[2]), e2(c[0]-a[0], c[1]-a[1], c[2]-a[2]);
+  return glm::cross(e1, e2);
+}
+
+//Collapse edges of a triangle list until it has about targetIndices indices (or nothing more
+//can go), reusing the existing vertices: a collapse moves one vertex onto a neighbour, so every
+//LOD shares the model's vertex buffer. Vertices on texture seams (a position shared by welded
+//vertices with different texcoords) and on open borders never move, so the LODs don't tear.
+//Collapses are done cheapest first, in passes of non-overlapping ones. error is the largest
+//collapse error, roughly how far (in model units) the result strays from the input.
+static void simplifyMesh(const vector<float>& verts, int stride, const vector<unsigned int>& in, size_t targetIndices,
+                         vector<unsigned int>& out, float& error){
+  int numVerts = verts.size()/stride;
+  out = in;
+  error = 0;
+  //Vertices at the same position share a position class (and a quadric)
+  unordered_map<VertexKey, int, VertexKeyHash> positions;
+  vector<int> posClass(numVerts);
+  vector<bool> locked(numVerts, false);
+  vector<int> classSize(numVerts, 0);
+  for (int v = 0; v < numVerts; v++){
+    VertexKey key = {&verts[v*stride], 3};
+    posClass[v] = positions.insert(make_pair(key, v)).first->second;
+    classSize[posClass[v]]++;
+  }
+  for (int v = 0; v < numVerts; v++) locked[v] = classSize[posClass[v]] > 1;
+  //Open borders: edges (between position classes) with only one triangle
+  unordered_map<unsigned long long, int> edgeUses;
+  for (size_t i = 0; i < in.size(); i += 3){
+    for (int k = 0; k < 3; k++){
+      unsigned int a = posClass[in[i+k]], b = posClass[in[i+(k+1)%3]];
+      edgeUses[(unsigned long long)min(a,b) << 32 | max(a,b)]++;
+    }
+  }
+  for (size_t i = 0; i < in.size(); i += 3){
+    for (int k = 0; k < 3; k++){
+      unsigned int a = posClass[in[i+k]], b = posClass[in[i+(k+1)%3]];
+      if (edgeUses[(unsigned long long)min(a,b) << 32 | max(a,b)] == 1) locked[in[i+k]] = locked[in[i+(k+1)%3]] = true;
+    }
+  }
+  for (int v = 0; v < numVerts; v++) if (locked[v]) locked[posClass[v]] = true;
+  for (int v = 0; v < numVerts; v++) if (locked[posClass[v]]) locked[v] = true;
+  //Every vertex starts with the planes of the triangles around it
+  vector<Quadric> quadrics(numVerts);
+  memset(quadrics.data(), 0, numVerts*sizeof(Quadric));
+  for (size_t i = 0; i < in.size(); i += 3){
+    const float* p = &verts[in[i]*stride];
+    glm::vec3 n = triangleNormal(p, &verts[in[i+1]*stride], &verts[in[i+2]*stride]);
+    float length = glm::length(n);
+    if (length == 0) continue;
+    n = n / length;
+    double d = -(n.x*p[0] + n.y*p[1] + n.z*p[2]);
+    Quadric plane = {n.x*(double)n.x, n.x*(double)n.y, n.x*(double)n.z, n.x*d, n.y*(double)n.y,
+                     n.y*(double)n.z, n.y*d, n.z*(double)n.z, n.z*d, d*d};
+    for (int k = 0; k < 3; k++) addQuadric(quadrics[posClass[in[i+k]]], plane);
+  }
+
+  struct Collapse{
+    double cost;
+    unsigned int from, to;
+    bool operator<(const Collapse& o) const { return cost < o.cost; }
+  };
+  vector<Collapse> collapses;
+  vector<int> adjStart(numVerts+1), adj;
+  vector<bool> touched(numVerts);
+  vector<unsigned int> remap(numVerts);
+  double maxCost = 0;
+  while (out.size() > targetIndices){
+    //Vertex -> triangle adjacency of what's left (CSR layout)
+    fill(adjStart.begin(), adjStart.end(), 0);
+    for (size_t i = 0; i < out.size(); i++) adjStart[out[i]+1]++;
+    for (int v = 0; v < numVerts; v++) adjStart[v+1] += adjStart[v];
+    adj.resize(out.size());
+    vector<int> fillAt(adjStart.begin(), adjStart.end()-1);
+    for (size_t i = 0; i < out.size(); i++) adj[fillAt[out[i]]++] = i/3;
+    //Each edge, in whichever direction is cheaper (and allowed)
+    collapses.clear();
+    for (size_t i = 0; i < out.size(); i += 3){
+      for (int k = 0; k < 3; k++){
+        unsigned int a = out[i+k], b = out[i+(k+1)%3];
+        if (a > b) continue; //Each shared edge once (its other triangle has it the other way round)
+        Quadric q = quadrics[posClass[a]];
+        addQuadric(q, quadrics[posClass[b]]);
+        Collapse c = {1e300, 0, 0};
+        if (!locked[a]){ c.cost = quadricError(q, &verts[b*stride]); c.from = a; c.to = b; }
+        if (!locked[b]){
+          double cost = quadricError(q, &verts[a*stride]);
+          if (cost < c.cost){ c.cost = cost; c.from = b; c.to = a; }
+        }
+        if (c.cost < 1e300) collapses.push_back(c);
+      }
+    }
+    sort(collapses.begin(), collapses.end());
+    size_t wanted = (out.size() - targetIndices)/6 + 1; //A collapse takes out about two triangles
+    fill(touched.begin(), touched.end(), false);
+    for (int v = 0; v < numVerts; v++) remap[v] = v;
+    size_t done = 0;
+    for (size_t c = 0; c < collapses.size() && done < wanted; c++){
+      unsigned int from = collapses[c].from, to = collapses[c].to;
+      if (touched[from] || touched[to]) continue;
+      //Don't fold any triangle over
+      bool flips = false;
+      for (int a = adjStart[from]; a < adjStart[from+1] && !flips; a++){
+        const unsigned int* t = &out[adj[a]*3];
+        if (t[0] == to || t[1] == to || t[2] == to) continue; //Goes away
+        const float* p[3];
+        for (int k = 0; k < 3; k++) p[k] = &verts[t[k]*stride];
+        glm::vec3 before = triangleNormal(p[0], p[1], p[2]);
+        for (int k = 0; k < 3; k++) if (t[k] == from) p[k] = &verts[to*stride];
+        glm::vec3 after = triangleNormal(p[0], p[1], p[2]);
+        flips = glm::dot(before, after) <= 0;
+      }
+      if (flips) continue;
+      remap[from] = to;
+      for (int a = adjStart[from]; a < adjStart[from+1]; a++){
+        for (int k = 0; k < 3; k++) touched[out[adj[a]*3+k]] = true;
+      }
+      touched[to] = true;
+      addQuadric(quadrics[posClass[to]], quadrics[posClass[from]]);
+      maxCost = max(maxCost, collapses[c].cost);
+      done++;
+    }
+    if (done == 0) break;
+    //Apply the pass and drop the triangles that collapsed
+    size_t kept = 0;
+    for (size_t i = 0; i < out.size(); i += 3){
+      unsigned int a = remap[out[i]], b = remap[out[i+1]], c = remap[out[i+2]];
+      if (a == b || b == c || a == c) continue;
+      out[kept++] = a;
+      out[kept++] = b;
+      out[kept++] = c;
+    }
+    out.resize(kept);
+  }
+  error = (float)sqrt(maxCost);
+}
+
+//Octahedral normal encoding: project onto the octahedron |x|+|y|+|z| = 1 and fold the lower
+//half over the upper, leaving two coordinates in -1..1
+static glm::vec2 octEncode(glm::vec3 n){
+  n = n / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+  glm::vec2 e(n.x, n.y);
+  if (n.z < 0){
+    e.x = (1 - fabsf(n.y)) * (n.x >= 0 ? 1 : -1);
+    e.y = (1 - fabsf(n.x)) * (n.y >= 0 ? 1 : -1);
+  }
+  return e;
+}
+
+static short packSnorm16(float v){
+  return (short)lroundf(glm::clamp(v, -1.f, 1.f) * 32767);
+}
+
+static unsigned short packUnorm16(float v){
+  return (unsigned short)lroundf(glm::clamp(v, 0.f, 1.f) * 65535);
+}
+
+//Quantize the welded float vertices (position, texcoord, normal) into PackedVertex, recording
+//in the header what the shaders need to decode them
+static void packVertices(const vector<float>& verts, int stride, MeshCacheHeader& header, vector<PackedVertex>& packed){
+  int numVerts = verts.size()/stride;
+  glm::vec3 lo(1e30f), hi(-1e30f);
+  glm::vec2 uvLo(1e30f), uvHi(-1e30f);
+  for (int v = 0; v < numVerts; v++){
+    const float* f = &verts[v*stride];
+    lo = glm::min(lo, glm::vec3(f[0], f[1], f[2]));
+    hi = glm::max(hi, glm::vec3(f[0], f[1], f[2]));
+    uvLo = glm::vec2(min(uvLo.x, f[3]), min(uvLo.y, f[4]));
+    uvHi = glm::vec2(max(uvHi.x, f[3]), max(uvHi.y, f[4]));
+  }
+  glm::vec3 center = (lo + hi) * .5f, half = (hi - lo) * .5f;
+  for (int i = 0; i < 3; i++){
+    header.center[i] = numVerts > 0 ? center[i] : 0;
+    header.halfExtent[i] = numVerts > 0 && half[i] > 0 ? half[i] : 1; //Flat (or empty) meshes
+  }
+  for (int i = 0; i < 2; i++){
+    header.texcoordMin[i] = numVerts > 0 ? uvLo[i] : 0;
+    header.texcoordExtent[i] = numVerts > 0 && uvHi[i] > uvLo[i] ? uvHi[i] - uvLo[i] : 1;
+  }
+  packed.resize(numVerts);
+  for (int v = 0; v < numVerts; v++){
+    const float* f = &verts[v*stride];
+    PackedVertex& p = packed[v];
+    for (int i = 0; i < 3; i++) p.position[i] = packSnorm16((f[i] - header.center[i]) / header.halfExtent[i]);
+    p.position[3] = 0; //The mesh's MeshDecode entry, set when it is loaded
+    for (int i = 0; i < 2; i++) p.texcoord[i] = packUnorm16((f[3+i] - header.texcoordMin[i]) / header.texcoordExtent[i]);
+    glm::vec3 n(f[5], f[6], f[7]);
+    glm::vec2 e = glm::length(n) > 0 ? octEncode(n) : glm::vec2(0, 0);
+    p.normal[0] = packSnorm16(e.x);
+    p.normal[1] = packSnorm16(e.y);
+  }
+}
+
+//Parse the text model (the original slow path) and write it out as a binary cache
+static bool buildMeshCache(const char* txtFileName, const char* cacheFileName){
+  Uint64 start = SDL_GetPerformanceCounter();
+  ifstream modelFile;
+  modelFile.open(txtFileName);
+  if (!modelFile){
+    printf("can't open model file %s\n", txtFileName);
+    return false;
+  }
+  int numLines = 0;
+  modelFile >> numLines;
+  float* model = new float[numLines];
+  for (int i = 0; i < numLines; i++){
+    modelFile >> model[i];
+  }
+  modelFile.close();
+
+  MeshCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "MSHC", 4);
+  header.version = MESH_CACHE_VERSION;
+  const int stride = 8; //Floats per vertex in the text file: position, texcoord, normal
+  header.vertexBytes = sizeof(PackedVertex);
+  header.numSourceVerts = numLines/stride;
+  header.numAttribs = NUM_ATTRIBS;
+  //The position is read as integers (its w is the mesh), the shaders scale it themselves
+  header.attribs[ATTRIB_POSITION].offset = offsetof(PackedVertex, position); header.attribs[ATTRIB_POSITION].components = 4;
+  header.attribs[ATTRIB_POSITION].type = GL_SHORT; header.attribs[ATTRIB_POSITION].normalized = 0;
+  header.attribs[ATTRIB_TEXCOORD].offset = offsetof(PackedVertex, texcoord); header.attribs[ATTRIB_TEXCOORD].components = 2;
+  header.attribs[ATTRIB_TEXCOORD].type = GL_UNSIGNED_SHORT; header.attribs[ATTRIB_TEXCOORD].normalized = 1;
+  header.attribs[ATTRIB_NORMAL].offset = offsetof(PackedVertex, normal); header.attribs[ATTRIB_NORMAL].components = 2;
+  header.attribs[ATTRIB_NORMAL].type = GL_SHORT; header.attribs[ATTRIB_NORMAL].normalized = 1;
+  header.textParseMs = (float)elapsedMs(start);
+
+  //Weld duplicates into an index buffer, then order triangles and vertices for the GPU caches
+  const int cacheSize = 16;
+  vector<float> verts;
+  vector<unsigned int> indices;
+  weldVertices(model, header.numSourceVerts, stride, verts, indices);
+  delete[] model;
+  int numVerts = verts.size()/stride;
+  float acmrBefore = vertexCacheACMR(indices, numVerts, cacheSize);
+  for (int v = 0; v < numVerts; v++){
+    const float* p = &verts[v*stride];
+    header.radius = max(header.radius, sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]));
+  }
+
+  //Each LOD aims for half the triangles of the one before. Stop once simplifying barely helps
+  //(what's left is mostly locked seams).
+  vector<unsigned int> lod = indices, simpler;
+  vector<unsigned int> allLods;
+  float error = 0;
+  char lodCounts[64] = "";
+  for (int l = 0; l < MAX_MESH_LODS; l++){
+    if (l > 0){
+      float passError;
+      simplifyMesh(verts, stride, lod, lod.size()/6*3, simpler, passError);
+      if (simpler.size() > lod.size()*4/5) break;
+      lod.swap(simpler);
+      error += passError; //An upper bound: each level was simplified from the last
+    }
+    optimizeVertexCache(lod, numVerts, cacheSize);
+    header.lods[l].firstIndex = allLods.size();
+    header.lods[l].numIndices = lod.size();
+    header.lods[l].error = error;
+    header.numLods++;
+    allLods.insert(allLods.end(), lod.begin(), lod.end());
+    sprintf(lodCounts + strlen(lodCounts), "%s%d", l > 0 ? "/" : "", (int)lod.size()/3);
+  }
+  indices.swap(allLods);
+  reorderVerticesByFirstUse(verts, indices, stride);
+  numVerts = verts.size()/stride;
+  vector<PackedVertex> packed;
+  packVertices(verts, stride, header, packed);
+  float acmrAfter = vertexCacheACMR(vector<unsigned int>(indices.begin(), indices.begin() + header.lods[0].numIndices), numVerts, cacheSize);
+  header.numVerts = numVerts;
+  header.numIndices = indices.size();
+
+  FILE* fp = fopen(cacheFileName, "wb");
+  if (fp == NULL){
+    printf("can't write mesh cache %s\n", cacheFileName);
+    return false;
+  }
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(packed.data(), sizeof(PackedVertex), packed.size(), fp);
+  fwrite(indices.data(), sizeof(unsigned int), indices.size(), fp);
+  fclose(fp);
+  printf("Built mesh cache %s (%d -> %d verts of %d -> %d bytes, ACMR %.2f -> %.2f, LOD triangles %s, text parse took %.2f ms)\n",
+         cacheFileName, header.numSourceVerts, header.numVerts, (int)(stride*sizeof(float)), header.vertexBytes,
+         acmrBefore, acmrAfter, lodCounts, header.textParseMs);
+  return true;
+}
+
+//Map a file read-only. Falls back to reading it into memory where mmap isn't available.
+//Files shorter than minLength are rejected.
+bool mapFile(const char* fileName, size_t minLength, void*& base, size_t& length){
+  base = NULL;
+  length = 0;
+#if defined(__APPLE__) || defined(__linux__)
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)minLength || st.st_size == 0){
+    close(fd);
+    return false;
+  }
+  void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); //The mapping keeps its own reference to the file
+  if (mapped == MAP_FAILED) return false;
+  base = mapped;
+  length = st.st_size;
+#else
+  FILE* fp = fopen(fileName, "rb");
+  if (fp == NULL) return false;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size < (long)minLength || size == 0){
+    fclose(fp);
+    return false;
+  }
+  char* buffer = new char[size];
+  fread(buffer, 1, size, fp);
+  fclose(fp);
+  base = buffer;
+  length = size;
+#endif
+  return true;
+}
+
+void unmapFile(void* base, size_t length){
+  if (base == NULL) return;
+#if defined(__APPLE__) || defined(__linux__)
+  munmap(base, length);
+#else
+  delete[] (char*)base;
+#endif
+}
+
+static bool mapMeshCache(const char* cacheFileName, MappedMesh& mesh){
+  if (!mapFile(cacheFileName, sizeof(MeshCacheHeader), mesh.mapBase, mesh.mapLength)) return false;
+  mesh.header = (const MeshCacheHeader*)mesh.mapBase;
+  mesh.verts = (const PackedVertex*)((const char*)mesh.mapBase + sizeof(MeshCacheHeader));
+  mesh.indices = (const unsigned int*)(mesh.verts + mesh.header->numVerts);
+  return true;
+}
+
+void unmapMeshCache(MappedMesh& mesh){
+  unmapFile(mesh.mapBase, mesh.mapLength);
+  mesh.mapBase = NULL;
+  mesh.header = NULL;
+  mesh.verts = NULL;
+  mesh.indices = NULL;
+}
+
+static bool validMeshCache(const MappedMesh& mesh){
+  const MeshCacheHeader* h = mesh.header;
+  if (memcmp(h->magic, "MSHC", 4) != 0 || h->version != MESH_CACHE_VERSION) return false;
+  if (h->numAttribs != NUM_ATTRIBS || h->vertexBytes != sizeof(PackedVertex) || h->numVerts < 0 || h->numIndices < 0) return false;
+  if (h->numLods < 1 || h->numLods > MAX_MESH_LODS) return false;
+  for (int l = 0; l < h->numLods; l++){
+    if (h->lods[l].firstIndex < 0 || h->lods[l].numIndices < 0 || h->lods[l].firstIndex + h->lods[l].numIndices > h->numIndices) return false;
+  }
+  return mesh.mapLength >= sizeof(MeshCacheHeader) + (size_t)h->numVerts*sizeof(PackedVertex)
+                                                   + (size_t)h->numIndices*sizeof(unsigned int);
+}
+
+//Load a model through its binary cache, rebuilding the cache if the .txt is newer (or the cache is bad)
+bool loadMeshCache(const char* txtFileName, MappedMesh& mesh){
+  Uint64 start = SDL_GetPerformanceCounter();
+  string cacheFileName = meshCacheName(txtFileName);
+  long long txtTime = fileModTime(txtFileName);
+  long long cacheTime = fileModTime(cacheFileName.c_str());
+  bool rebuilt = false;
+  if (cacheTime < 0 || txtTime > cacheTime){
+    if (!buildMeshCache(txtFileName, cacheFileName.c_str())) return false;
+    rebuilt = true;
+  }
+  if (!mapMeshCache(cacheFileName.c_str(), mesh)) return false;
+  if (!validMeshCache(mesh)){
+    unmapMeshCache(mesh);
+    if (rebuilt || !buildMeshCache(txtFileName, cacheFileName.c_str())) return false;
+    if (!mapMeshCache(cacheFileName.c_str(), mesh) || !validMeshCache(mesh)) return false;
+  }
+  printf("%s: %d verts (%d indices), cache load %.2f ms vs. text parse %.2f ms\n", txtFileName,
+         mesh.header->numVerts, mesh.header->numIndices, elapsedMs(start), mesh.header->textParseMs);
+  return true;
+}
+
+//// Level Loading ///////
+
+//"map2.txt" -> "map2.chunks"
+static string levelCacheName(const char* txtFileName){
+  string name = txtFileName;
+  size_t dot = name.rfind('.');
+  if (dot != string::npos) name = name.substr(0, dot);
+  return name + ".chunks";
+}
+
+//Parse a text map (a "width height" line followed by height rows of width cell codes) into
+//image, laid out like the compiled file: the header, then the chunks packed 4 bits per cell
+static bool parseLevelText(const char* fileName, vector<unsigned char>& image){
+  ifstream infile(fileName);
+  if (!infile){
+    printf("can't open map file %s\n", fileName);
+    return false;
+  }
+  LevelFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "MAPC", 4);
+  header.version = LEVEL_CACHE_VERSION;
+  if (!(infile >> header.width >> header.height) || header.width <= 0 || header.height <= 0){
+    printf("Bad map header in %s\n", fileName);
+    return false;
+  }
+  header.chunkSize = CHUNK_SIZE;
+  header.chunksX = (header.width + CHUNK_SIZE-1)/CHUNK_SIZE;
+  header.chunksY = (header.height + CHUNK_SIZE-1)/CHUNK_SIZE;
+  image.assign(sizeof(LevelFileHeader) + (size_t)header.chunksX*header.chunksY*CHUNK_BYTES, 0);
+  unsigned char* data = image.data() + sizeof(LevelFileHeader);
+  for (int i = 0; i < header.height; i++){
+    for (int j = 0; j < header.width; j++){
+      int c;
+      if (!(infile >> c) || c < 0 || c > 15){
+        printf("Map %s has a bad or missing cell at row %d, column %d\n", fileName, i, j);
+        return false;
+      }
+      size_t chunk = (size_t)(i/CHUNK_SIZE)*header.chunksX + j/CHUNK_SIZE;
+      int local = (i%CHUNK_SIZE)*CHUNK_SIZE + j%CHUNK_SIZE;
+      data[chunk*CHUNK_BYTES + (local>>1)] |= c << ((local&1)*4);
+
+      //The level-wide objects (the last of each in the file wins, as before)
+      if (c == CELL_WALL) header.numWalls++;
+      if (c == CELL_DOOR){
+        header.numDoors++;
+        header.doorCol = j; header.doorRow = i; header.hasDoor = 1;
+      }
+      if (c == CELL_KEY_PLATE || c == CELL_KEY_WATER){
+        header.numKeys++;
+        header.keyCol = j; header.keyRow = i; header.keyCode = c;
+      }
+      if (c == CELL_SPAWN){
+        header.spawnCol = j; header.spawnRow = i; header.hasSpawn = 1;
+      }
+    }
+  }
+  memcpy(image.data(), &header, sizeof(header));
+  return true;
+}
+
+//Parse a text map and write it out as the compiled file
+static bool compileLevel(const char* fileName, const char* cacheFileName){
+  Uint64 start = SDL_GetPerformanceCounter();
+  vector<unsigned char> image;
+  if (!parseLevelText(fileName, image)) return false;
+  FILE* fp = fopen(cacheFileName, "wb");
+  if (fp == NULL){
+    printf("can't write level cache %s\n", cacheFileName);
+    return false;
+  }
+  fwrite(image.data(), 1, image.size(), fp);
+  fclose(fp);
+  const LevelFileHeader* h = (const LevelFileHeader*)image.data();
+  printf("Compiled level %s (%dx%d cells, %dx%d chunks) in %.2f ms\n", cacheFileName,
+         h->width, h->height, h->chunksX, h->chunksY, elapsedMs(start));
+  return true;
+}
+
+//Parse a text map into a level that points at image rather than a mapping of the compiled
+//file. Nothing is written, mapped, streamed or spawned (-reparsemap times just the parse).
+bool parseLevel(const char* fileName, Level& level, vector<unsigned char>& image){
+  if (!parseLevelText(fileName, image)) return false;
+  const LevelFileHeader* h = (const LevelFileHeader*)image.data();
+  level.header = h;
+  level.mapBase = NULL;
+  level.mapLength = 0;
+  level.chunkData = image.data() + sizeof(LevelFileHeader);
+  level.width = h->width;
+  level.height = h->height;
+  level.chunksX = h->chunksX;
+  level.chunksY = h->chunksY;
+  level.spawn = glm::ivec2(h->spawnCol, h->spawnRow);
+  level.hasSpawn = h->hasSpawn != 0;
+  return true;
+}
+
+static bool validLevelCache(const void* base, size_t length){
+  const LevelFileHeader* h = (const LevelFileHeader*)base;
+  if (memcmp(h->magic, "MAPC", 4) != 0 || h->version != LEVEL_CACHE_VERSION) return false;
+  if (h->chunkSize != CHUNK_SIZE || h->width <= 0 || h->height <= 0) return false;
+  if (h->chunksX != (h->width + CHUNK_SIZE-1)/CHUNK_SIZE || h->chunksY != (h->height + CHUNK_SIZE-1)/CHUNK_SIZE) return false;
+  return length >= sizeof(LevelFileHeader) + (size_t)h->chunksX*h->chunksY*CHUNK_BYTES;
+}
+
+//Compile the map if needed and map it. No chunks are resident until streamLevel is called.
+//The entities and navigation are rebuilt for the new level.
+bool loadLevel(const char* fileName, Level& level){
+  string cacheFileName = levelCacheName(fileName);
+  long long txtTime = fileModTime(fileName);
+  long long cacheTime = fileModTime(cacheFileName.c_str());
+  bool rebuilt = false;
+  if (cacheTime < 0 || txtTime > cacheTime){
+    if (!compileLevel(fileName, cacheFileName.c_str())) return false;
+    rebuilt = true;
+  }
+  void* base;
+  size_t length;
+  bool mapped = mapFile(cacheFileName.c_str(), sizeof(LevelFileHeader), base, length);
+  if (mapped && !validLevelCache(base, length)){
+    unmapFile(base, length);
+    mapped = false;
+  }
+  if (!mapped){ //Stale format or truncated, rebuild it once
+    if (rebuilt || !compileLevel(fileName, cacheFileName.c_str())) return false;
+    if (!mapFile(cacheFileName.c_str(), sizeof(LevelFileHeader), base, length)) return false;
+    if (!validLevelCache(base, length)){
+      unmapFile(base, length);
+      return false;
+    }
+  }
+
+  const LevelFileHeader* h = (const LevelFileHeader*)base;
+  unloadLevel(level);
+  level.header = h;
+  level.mapBase = base;
+  level.mapLength = length;
+  level.chunkData = (const unsigned char*)base + sizeof(LevelFileHeader);
+  level.width = h->width;
+  level.height = h->height;
+  level.chunksX = h->chunksX;
+  level.chunksY = h->chunksY;
+  level.spawn = glm::ivec2(h->spawnCol, h->spawnRow);
+  level.hasSpawn = h->hasSpawn != 0;
+  level.chunks.reserve(CHUNK_BUDGET);
+  level.streamCenter = glm::ivec2(-1,-1);
+  level.pageIns = level.pageOuts = 0;
+  level.meshDirty = true;
+
+  spawnEntities(entities, level);
+  resetNavigation(nav, level, entities);
+  return true;
+}
+
+void unloadLevel(Level& level){
+  unmapFile(level.mapBase, level.mapLength);
+  level.mapBase = NULL;
+  level.mapLength = 0;
+  level.header = NULL;
+  level.chunkData = NULL;
+  level.chunks.clear();
+  level.slotOf.clear();
+}
+
+void printLevelInfo(const char* fileName, const Level& level){
+  printf("Loaded level %s: %dx%d, %d walls, %d doors, %d keys\n", fileName, level.width, level.height,
+         level.header->numWalls, level.header->numDoors, level.header->numKeys);
+}
+
+//// Static Level Mesh ///////
+
+//Cell code at (row, col) straight from the mapped file, or -1 if that cell is outside the level.
+//Every reader of the map goes through here, resident chunk or not.
+static int levelFileCell(const Level& level, int row, int col){
+  if (row < 0 || col < 0 || row >= level.height || col >= level.width) return -1;
+  size_t chunk = (size_t)(row/CHUNK_SIZE)*level.chunksX + col/CHUNK_SIZE;
+  int local = (row%CHUNK_SIZE)*CHUNK_SIZE + col%CHUNK_SIZE;
+  return (level.chunkData[chunk*CHUNK_BYTES + (local>>1)] >> ((local&1)*4)) & 0xF;
+}
+
+//The level as voxels: layer 0 is the floor (wood, under every cell), layer 1 holds the walls
+//(brick), nothing is above or below. Returns the voxel's texture id + 1, or 0 if it is empty. Doors come and go, so they
+//are drawn as props and don't count as solid here.
+static int levelVoxel(const Level& level, int layer, int row, int col){
+  int c = levelFileCell(level, row, col);
+  if (c < 0) return 0;
+  if (layer == 0) return 0+1;
+  if (layer == 1 && c == CELL_WALL) return 1+1;
+  return 0;
+}
+
+static void emitLevelQuad(vector<LevelVertex>& mesh, const float corner[3], const float du[3], const float dv[3],
+                          float w, float h, int axis, int side, int texID){
+  LevelVertex quad[4];
+  const float uvs[4][2] = {{0,0}, {w,0}, {w,h}, {0,h}}; //Texture repeats once per cell
+  for (int k = 0; k < 4; k++){
+    for (int a = 0; a < 3; a++){
+      quad[k].position[a] = corner[a] + (k==1||k==2 ? du[a] : 0) + (k==2||k==3 ? dv[a] : 0);
+      quad[k].normal[a] = (a == axis) ? (float)side : 0;
+    }
+    quad[k].texcoord[0] = uvs[k][0];
+    quad[k].texcoord[1] = uvs[k][1];
+    quad[k].texID = texID;
+  }
+  //Counter-clockwise seen from the side the face points to
+  if (side > 0){ mesh.push_back(quad[0]); mesh.push_back(quad[1]); mesh.push_back(quad[2]); mesh.push_back(quad[3]); }
+  else         { mesh.push_back(quad[0]); mesh.push_back(quad[3]); mesh.push_back(quad[2]); mesh.push_back(quad[1]); }
+}
+
+//Greedy meshing (after Lysenko): sweep a plane through the chunk along each axis, mark the
+//faces between a solid voxel and an empty one, and merge runs of faces with the same texture
+//into rectangles. Faces between two solid voxels are never emitted. World axes: x is the
+//layer (height), y the column and z the row, with voxel centers at (-2+layer, col, row).
+void buildChunkMesh(const Level& level, MapChunk& chunk){
+  chunk.mesh.clear();
+  const int dims[3] = {2, CHUNK_SIZE, CHUNK_SIZE};
+  const float origin[3] = {-2.5f, chunk.cx*CHUNK_SIZE - 0.5f, chunk.cy*CHUNK_SIZE - 0.5f};
+  int mask[CHUNK_SIZE*CHUNK_SIZE];
+  for (int d = 0; d < 3; d++){
+    int u = (d+1)%3, v = (d+2)%3;
+    int x[3] = {0,0,0}, q[3] = {0,0,0};
+    q[d] = 1;
+    for (x[d] = -1; x[d] < dims[d]; ){
+      //Mask of faces on the plane between slice x[d] and x[d]+1. Positive entries face +d and
+      //belong to the voxel behind the plane, negative ones face -d. Each chunk only emits faces
+      //of its own voxels; its neighbours are read so faces against them can be culled.
+      int n = 0;
+      for (x[v] = 0; x[v] < dims[v]; x[v]++){
+        for (x[u] = 0; x[u] < dims[u]; x[u]++, n++){
+          int a = levelVoxel(level, x[0], chunk.cy*CHUNK_SIZE + x[2], chunk.cx*CHUNK_SIZE + x[1]);
+          int b = levelVoxel(level, x[0]+q[0], chunk.cy*CHUNK_SIZE + x[2]+q[2], chunk.cx*CHUNK_SIZE + x[1]+q[1]);
+          bool aInside = x[d] >= 0, bInside = x[d]+1 < dims[d];
+          if (a && !b && aInside) mask[n] = a;
+          else if (b && !a && bInside) mask[n] = -b;
+          else mask[n] = 0;
+        }
+      }
+      x[d]++;
+
+      //Merge the mask into rectangles
+      n = 0;
+      for (int j = 0; j < dims[v]; j++){
+        for (int i = 0; i < dims[u]; ){
+          int c = mask[n];
+          if (c == 0){
+            i++; n++;
+            continue;
+          }
+          int w = 1;
+          while (i+w < dims[u] && mask[n+w] == c) w++;
+          int h = 1;
+          for (bool done = false; j+h < dims[v]; h++){
+            for (int k = 0; k < w; k++){
+              if (mask[n + k + h*dims[u]] != c){
+                done = true;
+                break;
+              }
+            }
+            if (done) break;
+          }
+          float corner[3], du[3] = {0,0,0}, dv[3] = {0,0,0};
+          corner[d] = origin[d] + x[d];
+          corner[u] = origin[u] + i;
+          corner[v] = origin[v] + j;
+          du[u] = w;
+          dv[v] = h;
+          emitLevelQuad(chunk.mesh, corner, du, dv, w, h, d, c > 0 ? 1 : -1, abs(c)-1);
+          for (int l = 0; l < h; l++){
+            for (int k = 0; k < w; k++) mask[n + k + l*dims[u]] = 0;
+          }
+          i += w;
+          n += w;
+        }
+      }
+    }
+  }
+}
+
+void queueLevelMesh(Level& level, GLuint program, GLuint texture, RenderQueue& queue){
+  if (level.meshDirty){
+    bindVertexArray(glState, levelVao); //For the index buffer
+    levelQuads = 0;
+    for (size_t c = 0; c < level.chunks.size(); c++) levelQuads += level.chunks[c].mesh.size()/4;
+    glBindBuffer(GL_ARRAY_BUFFER, levelVbo);
+    glBufferData(GL_ARRAY_BUFFER, levelQuads*4*sizeof(LevelVertex), NULL, GL_DYNAMIC_DRAW);
+    int quad = 0;
+    for (size_t c = 0; c < level.chunks.size(); c++){
+      level.chunks[c].firstQuad = quad;
+      size_t bytes = level.chunks[c].mesh.size()*sizeof(LevelVertex);
+      if (bytes == 0) continue;
+      glBufferSubData(GL_ARRAY_BUFFER, quad*4*sizeof(LevelVertex), bytes, level.chunks[c].mesh.data());
+      quad += level.chunks[c].mesh.size()/4;
+    }
+    //Every quad uses the same two triangles, so the index buffer only has to grow
+    if (levelQuads > levelEboQuads){
+      levelEboQuads = max(levelQuads, 2*levelEboQuads);
+      vector<unsigned int> indices(levelEboQuads*6);
+      for (int q = 0; q < levelEboQuads; q++){
+        const unsigned int quad[6] = {0,1,2, 0,2,3};
+        for (int k = 0; k < 6; k++) indices[q*6+k] = q*4 + quad[k];
+      }
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, levelEbo);
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+    }
+    level.meshDirty = false;
+  }
+  //One multi-draw over the index ranges of the chunks that survived culling (in whichever
+  //thread's list culled them)
+  int first = queue.multiCounts.size();
+  for (size_t t = 0; t < drawLists.size(); t++){
+    for (const ChunkBlock* block = drawLists[t].chunks; block != NULL; block = block->next){
+      for (int i = 0; i < block->count; i++){
+        const MapChunk& chunk = level.chunks[block->chunk[i]];
+        queue.multiCounts.push_back(chunk.mesh.size()/4*6);
+        queue.multiOffsets.push_back((const void*)(chunk.firstQuad*6*sizeof(unsigned int)));
+        renderStats.triangles += chunk.mesh.size()/4*2;
+        renderStats.vertices += chunk.mesh.size()/4*6;
+      }
+    }
+  }
+  int ranges = queue.multiCounts.size() - first;
+  if (ranges == 0) return;
+  RenderCommand draw = {program, levelVao, texture, DRAW_MULTI, ranges, first, 0, 1, 0};
+  queueDraw(queue, renderKey(program, texture, levelVao << 8 | 0xFF, 0), draw); //It's all around us
+}
+
+//Gribb & Hartmann: the frustum planes are sums/differences of the rows of proj*view
+void extractFrustum(const glm::mat4& m, Frustum& frustum){
+  glm::vec4 row[4];
+  for (int i = 0; i < 4; i++) row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+  frustum.planes[0] = row[3] + row[0]; //Left
+  frustum.planes[1] = row[3] - row[0]; //Right
+  frustum.planes[2] = row[3] + row[1]; //Bottom
+  frustum.planes[3] = row[3] - row[1]; //Top
+  frustum.planes[4] = row[3] + row[2]; //Near
+  frustum.planes[5] = row[3] - row[2]; //Far
+  for (int p = 0; p < 6; p++){
+    glm::vec4& pl = frustum.planes[p];
+    pl = pl * (1.0f/glm::length(glm::vec3(pl.x, pl.y, pl.z)));
+  }
+}
+
+//Conservative box test: only rejects a box entirely behind one of the planes
+bool boxInFrustum(const Frustum& frustum, glm::vec3 lo, glm::vec3 hi){
+  for (int p = 0; p < 6; p++){
+    const glm::vec4& pl = frustum.planes[p];
+    //The box corner farthest along the plane normal
+    glm::vec3 far(pl.x >= 0 ? hi.x : lo.x, pl.y >= 0 ? hi.y : lo.y, pl.z >= 0 ? hi.z : lo.z);
+    if (pl.x*far.x + pl.y*far.y + pl.z*far.z + pl.w < 0) return false;
+  }
+  return true;
+}
+
+//Flag the resident chunks whose bounds (floor to wall tops, keys included) are on screen and,
+//when a PVS is given, that contain at least one cell of it
+struct CullJob{
+  Level* level;
+  const Frustum* frustum;
+  const CellPVS* pvs;
+  glm::ivec2 center;
+};
+
+//Each resident chunk is a region: cull it and put it in this thread's list if it is to be drawn
+static void cullChunksJob(void* data, int begin, int end, int self){
+  const CullJob& job = *(const CullJob*)data;
+  Level& level = *job.level;
+  const CellPVS* pvs = job.pvs;
+  glm::ivec2 center = job.center;
+  DrawList& list = drawLists[self];
+  CullStats& cullStats = list.cull;
+  for (int c = begin; c < end; c++){
+    MapChunk& chunk = level.chunks[c];
+    glm::vec3 lo(-2.5f, chunk.cx*CHUNK_SIZE - 0.5f, chunk.cy*CHUNK_SIZE - 0.5f);
+    glm::vec3 hi(-0.5f, min((chunk.cx+1)*CHUNK_SIZE, level.width) - 0.5f, min((chunk.cy+1)*CHUNK_SIZE, level.height) - 0.5f);
+    chunk.visible = boxInFrustum(*job.frustum, lo, hi);
+    cullStats.tested++;
+    if (chunk.visible && pvs != NULL){
+      bool any = false;
+      int rowEnd = min((chunk.cy+1)*CHUNK_SIZE, center.y+PVS_RADIUS+1), colEnd = min((chunk.cx+1)*CHUNK_SIZE, center.x+PVS_RADIUS+1);
+      for (int i = max(chunk.cy*CHUNK_SIZE, center.y-PVS_RADIUS); i < rowEnd && !any; i++){
+        for (int j = max(chunk.cx*CHUNK_SIZE, center.x-PVS_RADIUS); j < colEnd && !any; j++){
+          any = pvsVisible(pvs, center, i, j);
+        }
+      }
+      if (!any){
+        chunk.visible = false;
+        cullStats.pvsCulled++;
+      }
+    }
+    if (chunk.visible) cullStats.drawn++;
+    else cullStats.culled++;
+    if (chunk.visible && !chunk.mesh.empty()) emitChunk(list, c);
+  }
+}
+
+//Start of the frame's scene traversal, which fills the draw lists
+void cullLevel(Level& level, const Frustum& frustum, const CellPVS* pvs){
+  resetDrawLists();
+  CullJob job = {&level, &frustum, pvs, playerCell()};
+  parallelFor(jobSystem, level.chunks.size(), 1, cullChunksJob, &job);
+  for (size_t t = 0; t < drawLists.size(); t++){
+    cullStats.tested += drawLists[t].cull.tested;
+    cullStats.culled += drawLists[t].cull.culled;
+    cullStats.pvsCulled += drawLists[t].cull.pvsCulled;
+    cullStats.drawn += drawLists[t].cull.drawn;
+  }
+}
+
+//// Collision ///////
+
+//Walls and the level's edge, and doors until they are opened (es holds the doors). Read from
+//the mapped file, so chunks that aren't paged in still collide. Also what blocks sight for the
+//PVS, and what the navigation grid is built from.
+bool cellSolid(const Level& level, const EntityStore& es, int row, int col){
+  int c = levelFileCell(level, row, col);
+  if (c != CELL_DOOR) return c < 0 || c == CELL_WALL;
+  unordered_map<long long,int>::const_iterator door = es.doorAt.find((long long)row*level.width + col);
+  return door == es.doorAt.end() || es.active[door->second];
+}
+
+//Cells k with a box from lo to hi strictly inside them: k-.5 < hi and k+.5 > lo
+static inline int firstCellOver(float lo){ return (int)floor(lo - .5f) + 1; }
+static inline int lastCellOver(float hi){ return (int)ceil(hi + .5f) - 1; }
+
+//Move the box along one axis (0 = columns, 1 = rows), stopping at the first solid cell its
+//leading edge reaches. Cells are visited in order, so any distance is safe.
+static float sweepAxis(glm::vec2 center, glm::vec2 half, int axis, float delta, bool& blocked){
+  int other = 1-axis;
+  int lo = firstCellOver(center[other] - half[other]), hi = lastCellOver(center[other] + half[other]);
+  float dir = delta > 0 ? 1 : -1;
+  float lead = center[axis] + dir*half[axis];
+  float target = lead + delta;
+  //Cell the leading edge is in (or touching, going forwards) and the one it ends up in
+  int from = delta > 0 ? (int)floor(lead + .5f) : (int)ceil(lead - .5f);
+  int to = delta > 0 ? (int)floor(target + .5f) : (int)ceil(target - .5f);
+  for (int k = from; delta > 0 ? k <= to : k >= to; k += (int)dir){
+    for (int o = lo; o <= hi; o++){
+      bool solid = axis == 0 ? cellSolid(level, entities, o, k) : cellSolid(level, entities, k, o);
+      if (!solid) continue;
+      float wall = k - dir*.5f; //The face we hit
+      float stop = wall - dir*(half[axis] + COLLISION_SKIN);
+      blocked = true;
+      //Never move backwards, a box already touching the wall just stays put
+      return delta > 0 ? max(center[axis], min(stop, center[axis] + delta)) : min(center[axis], max(stop, center[axis] + delta));
+    }
+  }
+  return center[axis] + delta;
+}
+
+//Swept AABB against the level grid. Each axis is resolved on its own, which is what lets a box
+//moving diagonally into a wall keep sliding along it. Returns the new center.
+glm::vec2 moveAndSlide(const Box2& box, glm::vec2 delta, bool* blocked){
+  glm::vec2 center = box.center;
+  bool hit = false;
+  //The longer move first, so a graze on the short axis doesn't stop the long one
+  int first = fabs(delta.x) >= fabs(delta.y) ? 0 : 1;
+  for (int pass = 0; pass < 2; pass++){
+    int axis = pass == 0 ? first : 1-first;
+    if (delta[axis] != 0) center[axis] = sweepAxis(center, box.half, axis, delta[axis], hit);
+  }
+  if (blocked) *blocked = hit;
+  return center;
+}
+
+static inline unsigned int spatialBucket(int x, int y, unsigned int mask){
+  return ((unsigned int)x*73856093u ^ (unsigned int)y*19349663u) & mask;
+}
+
+//Counting sort of hash.boxes into buckets by the hash cells they overlap. Linear in the number
+//of boxes, and nothing is allocated once the arrays have grown to size.
+void buildSpatialHash(SpatialHash& hash, float cellSize){
+  hash.cellSize = cellSize;
+  unsigned int buckets = 64;
+  while (buckets < 2*hash.boxes.size()) buckets *= 2;
+  hash.mask = buckets-1;
+  hash.bucketStart.assign(buckets+1, 0);
+  static vector<unsigned int> owned; //Bucket of each entry, in box order
+  owned.clear();
+  for (size_t b = 0; b < hash.boxes.size(); b++){
+    const Box2& box = hash.boxes[b];
+    int x0 = floor((box.center.x - box.half.x)/cellSize), x1 = floor((box.center.x + box.half.x)/cellSize);
+    int y0 = floor((box.center.y - box.half.y)/cellSize), y1 = floor((box.center.y + box.half.y)/cellSize);
+    size_t firstOwned = owned.size();
+    for (int y = y0; y <= y1; y++){
+      for (int x = x0; x <= x1; x++){
+        unsigned int bucket = spatialBucket(x, y, hash.mask);
+        if (find(owned.begin()+firstOwned, owned.end(), bucket) != owned.end()) continue; //Once per bucket
+        owned.push_back(bucket);
+        hash.bucketStart[bucket+1]++;
+      }
+    }
+    owned.push_back(~0u); //End of this box
+  }
+  for (unsigned int b = 0; b < buckets; b++) hash.bucketStart[b+1] += hash.bucketStart[b];
+  hash.entries.resize(hash.bucketStart[buckets]);
+  static vector<int> fill;
+  fill.assign(hash.bucketStart.begin(), hash.bucketStart.end()-1);
+  int box = 0;
+  for (size_t e = 0; e < owned.size(); e++){
+    if (owned[e] == ~0u) box++;
+    else hash.entries[fill[owned[e]]++] = box;
+  }
+}
+
+//Every box in the hash that overlaps this one, each once
+void querySpatialHash(const SpatialHash& hash, const Box2& box, vector<int>& found){
+  found.clear();
+  if (hash.entries.empty()) return;
+  glm::vec2 lo = box.center - box.half, hi = box.center + box.half;
+  int x0 = floor(lo.x/hash.cellSize), x1 = floor(hi.x/hash.cellSize);
+  int y0 = floor(lo.y/hash.cellSize), y1 = floor(hi.y/hash.cellSize);
+  for (int y = y0; y <= y1; y++){
+    for (int x = x0; x <= x1; x++){
+      unsigned int bucket = spatialBucket(x, y, hash.mask);
+      for (int e = hash.bucketStart[bucket]; e < hash.bucketStart[bucket+1]; e++){
+        const Box2& other = hash.boxes[hash.entries[e]];
+        glm::vec2 otherLo = other.center - other.half, otherHi = other.center + other.half;
+        if (otherLo.x >= hi.x || otherHi.x <= lo.x || otherLo.y >= hi.y || otherHi.y <= lo.y) continue;
+        //Only report the pair from the cell holding the corner where the two boxes start to
+        //overlap, a box spanning several cells (or a bucket shared by two cells) would repeat
+        int ownerX = floor(max(lo.x, otherLo.x)/hash.cellSize), ownerY = floor(max(lo.y, otherLo.y)/hash.cellSize);
+        if (ownerX != x || ownerY != y) continue;
+        found.push_back(hash.entries[e]);
+      }
+    }
+  }
+}
+
+//The trigger colliders go in their own spatial hash. They don't move, so this is only redone
+//when the entities are.
+void buildTriggers(CollisionWorld& world, const EntityStore& es){
+  world.triggerHash.boxes.clear();
+  world.triggerEntity.clear();
+  for (int e = 0; e < es.count(); e++){
+    if (es.collider[e] != COLLIDER_TRIGGER) continue;
+    Box2 box = {glm::vec2(es.col[e], es.row[e]), glm::vec2(es.half[e])};
+    world.triggerHash.boxes.push_back(box);
+    world.triggerEntity.push_back(e);
+  }
+  buildSpatialHash(world.triggerHash, 1);
+}
+
+//// Entities ///////
+
+int addEntity(EntityStore& es, int kind, glm::vec2 cell, int model, int texID, float scale, float spin,
+              int collider, float half, int keyCode){
+  es.kind.push_back(kind);
+  es.active.push_back(1);
+  es.col.push_back(cell.x);
+  es.row.push_back(cell.y);
+  es.height.push_back(0);
+  es.prevCol.push_back(cell.x);
+  es.prevRow.push_back(cell.y);
+  es.prevHeight.push_back(0);
+  es.moveCol.push_back(0);
+  es.moveRow.push_back(0);
+  es.model.push_back(model);
+  es.texID.push_back(texID);
+  es.scale.push_back(scale);
+  es.spin.push_back(spin);
+  es.lod.push_back(0);
+  es.lightColor.push_back(glm::vec3(0));
+  es.lightRadius.push_back(0);
+  es.collider.push_back(collider);
+  es.half.push_back(half);
+  es.keyCode.push_back(keyCode);
+  es.keysHeld.push_back(0);
+  es.navField.push_back(NAV_CHASE);
+  return es.count()-1;
+}
+
+//A torch on a wall next to some of the open cells, the same cells every time (a hash picks
+//about one in torchSpacing)
+static void addTorch(EntityStore& es, const Level& level, int row, int col){
+  unsigned int h = (unsigned int)row*2654435761u + (unsigned int)col; //Mixed as in MurmurHash3's finalizer
+  h ^= h >> 16; h *= 0x85ebca6bu; h ^= h >> 13; h *= 0xc2b2ae35u; h ^= h >> 16;
+  if (h % torchSpacing != 0) return;
+  const int dirs[4][2] = {{0,1}, {0,-1}, {1,0}, {-1,0}}; //(row, col) steps
+  for (int d = 0; d < 4; d++){
+    if (levelFileCell(level, row + dirs[d][0], col + dirs[d][1]) != CELL_WALL) continue;
+    glm::vec2 at(col + .4f*dirs[d][1], row + .4f*dirs[d][0]);
+    int e = addEntity(es, ENTITY_TORCH, at, MODEL_CUBE, 0, .15f, 0, COLLIDER_NONE, 0, 0);
+    es.height[e] = es.prevHeight[e] = .3f; //Up the wall
+    es.lightColor[e] = glm::vec3(1.f, .55f, .2f);
+    es.lightRadius[e] = 3;
+    return;
+  }
+}
+
+//Make the player, and a key or a door for every key or door cell in the level. On a reload the
+//player keeps its place and its keys, and keys and doors that were used stay used.
+void spawnEntities(EntityStore& es, const Level& level){
+  bool hadPlayer = es.player >= 0;
+  glm::vec3 playerAt;
+  unsigned int playerKeys = 0;
+  if (hadPlayer){
+    playerAt = glm::vec3(es.col[es.player], es.row[es.player], es.height[es.player]);
+    playerKeys = es.keysHeld[es.player];
+  }
+  static vector<long long> usedCells;
+  usedCells.clear();
+  for (int e = 0; e < es.count(); e++){
+    if (es.kind[e] != ENTITY_PLAYER && !es.active[e]) usedCells.push_back((long long)floor(es.row[e]+.5f)*level.width + (long long)floor(es.col[e]+.5f));
+  }
+  sort(usedCells.begin(), usedCells.end());
+
+  EntityStore fresh;
+  const LevelFileHeader* h = level.header;
+  if (level.hasSpawn){
+    bool inside = hadPlayer && playerAt.x >= 0 && playerAt.y >= 0 && playerAt.x < level.width && playerAt.y < level.height;
+    glm::vec2 at = inside ? glm::vec2(playerAt.x, playerAt.y) : glm::vec2(level.spawn.x, level.spawn.y);
+    fresh.player = addEntity(fresh, ENTITY_PLAYER, at, MODEL_KNOT, 1, .3f, 0, COLLIDER_SOLID, PLAYER_HALF, 0);
+    if (inside){
+      fresh.height[fresh.player] = fresh.prevHeight[fresh.player] = playerAt.z;
+      fresh.keysHeld[fresh.player] = playerKeys;
+    }
+    fresh.lightColor[fresh.player] = glm::vec3(.7f, .7f, .8f); //A lantern
+    fresh.lightRadius[fresh.player] = 2.5f;
+  }
+  //Every door needs the level's key (the map format has one kind of key per level)
+  int doorKey = h->keyCode;
+  for (int cy = 0; cy < level.chunksY; cy++){
+    for (int cx = 0; cx < level.chunksX; cx++){
+      const unsigned char* cells = level.chunkData + ((size_t)cy*level.chunksX + cx)*CHUNK_BYTES;
+      for (int i = 0; i < CHUNK_SIZE*CHUNK_SIZE; i++){
+        int c = (cells[i>>1] >> ((i&1)*4)) & 0xF;
+        int row = cy*CHUNK_SIZE + i/CHUNK_SIZE, col = cx*CHUNK_SIZE + i%CHUNK_SIZE;
+        if (c != CELL_WALL && c != CELL_DOOR && torchSpacing > 0) addTorch(fresh, level, row, col);
+        if (c != CELL_DOOR && c != CELL_KEY_PLATE && c != CELL_KEY_WATER) continue;
+        int e;
+        if (c == CELL_DOOR){
+          //Doors are solid through the grid (see cellSolid), their trigger sticks out of the
+          //cell a little so walking up to one with the key opens it
+          e = addEntity(fresh, ENTITY_DOOR, glm::vec2(col, row), MODEL_CUBE, keyTexture(doorKey), 1, 0, COLLIDER_TRIGGER, .55f, doorKey);
+          fresh.doorAt[(long long)row*level.width + col] = e;
+        }
+        else {
+          e = addEntity(fresh, ENTITY_KEY, glm::vec2(col, row), MODEL_TEAPOT, keyTexture(c), .4f, 1, COLLIDER_TRIGGER, .5f, c);
+          fresh.lightColor[e] = glm::vec3(.9f, .75f, .35f);
+          fresh.lightRadius[e] = 1.5f;
+        }
+        if (binary_search(usedCells.begin(), usedCells.end(), (long long)row*level.width + col)){
+          fresh.active[e] = 0;
+        }
+      }
+    }
+  }
+  //Agents start on random open cells (the same ones every run), half of them chasing the
+  //player and half heading for the keys and doors
+  unsigned int seed = 12345;
+  for (int a = 0, tries = 0; a < agentCount && tries < 100*agentCount; tries++){
+    seed = seed*1664525u + 1013904223u;
+    int col = (seed >> 8) % level.width;
+    seed = seed*1664525u + 1013904223u;
+    int row = (seed >> 8) % level.height;
+    int c = levelFileCell(level, row, col);
+    if (c < 0 || c == CELL_WALL || c == CELL_DOOR) continue;
+    int e = addEntity(fresh, ENTITY_AGENT, glm::vec2(col, row), MODEL_SPHERE, 0, .15f, 0, COLLIDER_NONE, .15f, 0);
+    fresh.navField[e] = a%2 ? NAV_OBJECTIVES : NAV_CHASE;
+    a++;
+  }
+  swap(es, fresh);
+  buildTriggers(collision, es);
+}
+
+//Apply each entity's wanted movement, sliding along the level's walls if it has a collider
+void moveEntities(EntityStore& es){
+  for (int e = 0; e < es.count(); e++){
+    if (es.moveCol[e] == 0 && es.moveRow[e] == 0) continue;
+    glm::vec2 delta(es.moveCol[e], es.moveRow[e]);
+    if (es.collider[e] == COLLIDER_SOLID){
+      Box2 box = {glm::vec2(es.col[e], es.row[e]), glm::vec2(es.half[e])};
+      glm::vec2 to = moveAndSlide(box, delta);
+      es.col[e] = to.x;
+      es.row[e] = to.y;
+    }
+    else {
+      es.col[e] += delta.x;
+      es.row[e] += delta.y;
+    }
+    es.moveCol[e] = es.moveRow[e] = 0;
+  }
+}
+
+//Whoever can carry keys picks up the keys it walks into, and opens the doors it walks into if
+//it has their key
+void triggerEntities(EntityStore& es){
+  static vector<int> touching;
+  for (int e = 0; e < es.count(); e++){
+    if (es.kind[e] != ENTITY_PLAYER || !es.active[e]) continue;
+    Box2 box = {glm::vec2(es.col[e], es.row[e]), glm::vec2(es.half[e])};
+    querySpatialHash(collision.triggerHash, box, touching);
+    for (size_t t = 0; t < touching.size(); t++){
+      int other = collision.triggerEntity[touching[t]];
+      if (!es.active[other]) continue;
+      if (es.kind[other] == ENTITY_KEY){
+        es.keysHeld[e] |= 1u << es.keyCode[other];
+        es.active[other] = 0;
+      }
+      if (es.kind[other] == ENTITY_DOOR && (es.keysHeld[e] >> es.keyCode[other] & 1)){
+        es.active[other] = 0;
+        pvsDoorChanged(level, (int)es.row[other], (int)es.col[other]);
+        navDoorOpened(nav, (int)es.row[other], (int)es.col[other]);
+      }
+    }
+  }
+}
+
+glm::vec3 entityDrawPosition(const EntityStore& es, int e){
+  //x is up in the maze, the walking level is at -1
+  return glm::vec3(-1 + es.prevHeight[e] + (es.height[e]-es.prevHeight[e])*simAlpha,
+                   es.prevCol[e] + (es.col[e]-es.prevCol[e])*simAlpha,
+                   es.prevRow[e] + (es.row[e]-es.prevRow[e])*simAlpha);
+}
+
+struct EntityDrawJob{
+  EntityStore* es;
+  const unsigned char* chunkVisible;
+  glm::ivec2 center;
+};
+
+//The coarsest level of detail whose error stays under LOD_PIXEL_ERROR pixels on screen. The
+//bounding sphere's projected radius gives pixels per model unit at this distance (depth is the
+//view depth of the origin, taken at the sphere's near side). To keep levels from flickering
+//between two choices as things move, a prop only goes coarser once the next level would be
+//well under the limit.
+static int selectLod(const MeshRange& mesh, float scale, float depth, int current){
+  if (mesh.numLods <= 1) return 0;
+  float nearest = max(depth - mesh.radius*scale, .05f);
+  float sphereRadius = mesh.radius*scale*frameUniforms.proj[1][1]*screenHeight/2/nearest; //Pixels
+  float pixelsPerUnit = sphereRadius/mesh.radius;
+  int lod = min(current, mesh.numLods-1);
+  while (lod > 0 && mesh.lods[lod].error*pixelsPerUnit > LOD_PIXEL_ERROR) lod--;
+  while (lod+1 < mesh.numLods && mesh.lods[lod+1].error*pixelsPerUnit < LOD_PIXEL_ERROR*LOD_HYSTERESIS) lod++;
+  return lod;
+}
+
+//Lights are tested against the frustum on their own, one can shine into view from a chunk that
+//isn't in it. Torches flicker.
+static void emitLight(DrawList& list, const EntityStore& es, int e){
+  glm::vec3 at = entityDrawPosition(es, e);
+  float radius = es.lightRadius[e];
+  for (int p = 0; p < 6; p++){
+    const glm::vec4& pl = viewFrustum.planes[p];
+    if (pl.x*at.x + pl.y*at.y + pl.z*at.z + pl.w < -radius) return;
+  }
+  glm::vec3 color = es.lightColor[e];
+  if (es.kind[e] == ENTITY_TORCH) color = color * (.85f + .1f*sinf(timePast*11 + e) + .05f*sinf(timePast*23 + 2.f*e));
+  LightGPU light = {frameUniforms.view * glm::vec4(at, 1), glm::vec4(color, 0)};
+  light.viewPosition.w = radius;
+  list.lights.push_back(light);
+}
+
+static void drawEntitiesJob(void* data, int begin, int end, int self){
+  const EntityDrawJob& job = *(const EntityDrawJob*)data;
+  EntityStore& es = *job.es;
+  DrawList& list = drawLists[self];
+  clearTransforms(list.transforms);
+  list.picked.clear();
+  for (int e = begin; e < end; e++){
+    if (!es.active[e]) continue;
+    if (es.lightRadius[e] > 0) emitLight(list, es, e);
+    int row = (int)floor(es.row[e]+.5f), col = (int)floor(es.col[e]+.5f);
+    if (row < 0 || col < 0 || row >= level.height || col >= level.width) continue;
+    if (!job.chunkVisible[(size_t)(row/CHUNK_SIZE)*level.chunksX + col/CHUNK_SIZE]) continue;
+    if (cellPVS != NULL && e != es.player && !pvsVisible(cellPVS, job.center, row, col)) continue;
+    //The keys tumble about two axes, the same way they always have
+    float t = timePast * es.spin[e];
+    glm::vec4 spin = quatMul(axisAngle(glm::vec3(0,1,1), t*3.14f/2), axisAngle(glm::vec3(1,0,0), t*3.14f/4));
+    addTransform(list.transforms, entityDrawPosition(es, e), glm::vec3(es.scale[e]), spin);
+    list.picked.push_back(e);
+  }
+  if (list.picked.empty()) return;
+  runTransforms(list.transforms, frameUniforms.view, frameUniforms.proj);
+  for (size_t i = 0; i < list.picked.size(); i++){
+    int e = list.picked[i];
+    es.lod[e] = selectLod(modelRanges[es.model[e]], es.scale[e], list.transforms.out[i].mvp[3][3], es.lod[e]);
+    emitProp(list, es.model[e], es.lod[e], list.transforms.out[i], es.texID[e]);
+  }
+}
+
+//Every active entity in a chunk that survived culling (and in the PVS, when there is one) goes
+//into the draw lists, in jobs of a few thousand entities
+void drawEntities(EntityStore& es){
+  static vector<unsigned char> chunkVisible;
+  chunkVisible.assign((size_t)level.chunksX*level.chunksY, 0);
+  for (size_t c = 0; c < level.chunks.size(); c++){
+    if (level.chunks[c].visible) chunkVisible[(size_t)level.chunks[c].cy*level.chunksX + level.chunks[c].cx] = 1;
+  }
+  EntityDrawJob job = {&es, chunkVisible.data(), playerCell()};
+  parallelFor(jobSystem, es.count(), 4096, drawEntitiesJob, &job);
+}
+
+//// Lights ///////
+
+void startLights(LightClusters& lights){
+  glGenBuffers(3, lights.buffers);
+  glGenTextures(3, lights.textures);
+  const GLenum formats[3] = {GL_RGBA32F, GL_RG32UI, GL_R32UI};
+  const int units[3] = {LIGHT_DATA_UNIT, LIGHT_GRID_UNIT, LIGHT_INDEX_UNIT};
+  for (int b = 0; b < 3; b++){
+    glBindBuffer(GL_TEXTURE_BUFFER, lights.buffers[b]);
+    glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+    glActiveTexture(GL_TEXTURE0 + units[b]);
+    glBindTexture(GL_TEXTURE_BUFFER, lights.textures[b]); //Stays bound, only the buffer contents change
+    glTexBuffer(GL_TEXTURE_BUFFER, formats[b], lights.buffers[b]);
+  }
+  glActiveTexture(GL_TEXTURE0 + MATERIAL_UNIT);
+  //No lights until the first frame is binned
+  lights.tilesX = (screenWidth + CLUSTER_TILE-1)/CLUSTER_TILE;
+  lights.tilesY = (screenHeight + CLUSTER_TILE-1)/CLUSTER_TILE;
+  lights.grid.assign((size_t)lights.tilesX*lights.tilesY*CLUSTER_SLICES*2, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, lights.buffers[1]);
+  glBufferData(GL_TEXTURE_BUFFER, lights.grid.size()*sizeof(unsigned int), lights.grid.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void stopLights(LightClusters& lights){
+  glDeleteTextures(3, lights.textures);
+  glDeleteBuffers(3, lights.buffers);
+}
+
+//Depth slice of a view depth, the same way the fragment shader works it out
+static int lightSlice(float depth){
+  const float* d = frameUniforms.clusterDepth;
+  return (int)floorf(logf(depth/d[0]) * d[2]);
+}
+
+static short clampTile(float ndc, int size, int tiles){
+  int tile = (int)floorf((ndc*.5f + .5f)*size/CLUSTER_TILE);
+  return (short)max(0, min(tiles-1, tile));
+}
+
+//The clusters each light's view space bounding box covers. x/depth and y/depth are largest and
+//smallest at corners of the box, so projecting its corners bounds it on screen.
+static void boundLightsJob(void* data, int begin, int end, int self){
+  LightClusters& lights = *(LightClusters*)data;
+  const glm::mat4& proj = frameUniforms.proj;
+  const float* depth = frameUniforms.clusterDepth;
+  for (int i = begin; i < end; i++){
+    glm::vec4 p = lights.lights[i].viewPosition;
+    float r = p.w;
+    float zNear = max(-p.z - r, depth[0]), zFar = min(-p.z + r, depth[1]);
+    LightBin& bin = lights.bins[i];
+    if (zNear > zFar){ //Not in front of us after all
+      bin.z0 = 1;
+      bin.z1 = 0;
+      continue;
+    }
+    float lo[2] = {1e30f, 1e30f}, hi[2] = {-1e30f, -1e30f};
+    for (int a = 0; a < 2; a++){
+      for (int side = -1; side <= 1; side += 2){
+        for (int d = 0; d < 2; d++){
+          float ndc = proj[a][a] * (p[a] + side*r) / (d ? zFar : zNear);
+          lo[a] = min(lo[a], ndc);
+          hi[a] = max(hi[a], ndc);
+        }
+      }
+    }
+    bin.x0 = clampTile(lo[0], screenWidth, lights.tilesX);
+    bin.x1 = clampTile(hi[0], screenWidth, lights.tilesX);
+    bin.y0 = clampTile(lo[1], screenHeight, lights.tilesY);
+    bin.y1 = clampTile(hi[1], screenHeight, lights.tilesY);
+    bin.z0 = max(0, min(CLUSTER_SLICES-1, lightSlice(zNear)));
+    bin.z1 = max(0, min(CLUSTER_SLICES-1, lightSlice(zFar)));
+  }
+}
+
+//Does a light's sphere reach a cluster? The cluster's view space bounding box spans its tile
+//at both the near and the far depth of its slice.
+static bool lightReaches(glm::vec4 light, int x, int y, float nearDepth, float farDepth){
+  const glm::mat4& proj = frameUniforms.proj;
+  int tile[2] = {x, y}, size[2] = {screenWidth, screenHeight};
+  float distance2 = 0;
+  for (int a = 0; a < 2; a++){
+    float lo = (tile[a]*CLUSTER_TILE/(float)size[a]*2 - 1) / proj[a][a]; //Per unit of depth
+    float hi = ((tile[a]+1)*CLUSTER_TILE/(float)size[a]*2 - 1) / proj[a][a];
+    float boxLo = min(lo*nearDepth, lo*farDepth), boxHi = max(hi*nearDepth, hi*farDepth);
+    float d = light[a] < boxLo ? boxLo - light[a] : light[a] > boxHi ? light[a] - boxHi : 0;
+    distance2 += d*d;
+  }
+  float depth = -light.z;
+  float d = depth < nearDepth ? nearDepth - depth : depth > farDepth ? depth - farDepth : 0;
+  distance2 += d*d;
+  return distance2 <= light.w*light.w;
+}
+
+//Each job builds whole depth slices, their part of the grid and their own index lists, so no
+//two jobs write the same memory. First and count in the grid are within the slice for now.
+static void fillSlicesJob(void* data, int begin, int end, int self){
+  LightClusters& lights = *(LightClusters*)data;
+  int perSlice = lights.tilesX*lights.tilesY;
+  const float* depth = frameUniforms.clusterDepth;
+  for (int z = begin; z < end; z++){
+    unsigned int* grid = &lights.grid[(size_t)z*perSlice*2];
+    memset(grid, 0, perSlice*2*sizeof(unsigned int));
+    float nearDepth = depth[0]*expf(z/depth[2]), farDepth = depth[0]*expf((z+1)/depth[2]);
+    for (size_t i = 0; i < lights.bins.size(); i++){
+      const LightBin& b = lights.bins[i];
+      if (z < b.z0 || z > b.z1) continue;
+      for (int y = b.y0; y <= b.y1; y++){
+        for (int x = b.x0; x <= b.x1; x++){
+          if (lightReaches(lights.lights[i].viewPosition, x, y, nearDepth, farDepth)) grid[(y*lights.tilesX + x)*2 + 1]++;
+        }
+      }
+    }
+    unsigned int total = 0;
+    for (int c = 0; c < perSlice; c++){
+      grid[c*2] = total;
+      total += grid[c*2+1];
+      grid[c*2+1] = 0;
+    }
+    vector<unsigned int>& indices = lights.sliceIndices[z];
+    indices.resize(total);
+    for (size_t i = 0; i < lights.bins.size(); i++){
+      const LightBin& b = lights.bins[i];
+      if (z < b.z0 || z > b.z1) continue;
+      for (int y = b.y0; y <= b.y1; y++){
+        for (int x = b.x0; x <= b.x1; x++){
+          if (!lightReaches(lights.lights[i].viewPosition, x, y, nearDepth, farDepth)) continue;
+          unsigned int* cluster = &grid[(y*lights.tilesX + x)*2];
+          indices[cluster[0] + cluster[1]++] = i;
+        }
+      }
+    }
+  }
+}
+
+static void uploadLightBuffer(GLuint buffer, const void* data, size_t bytes){
+  glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+  glBufferData(GL_TEXTURE_BUFFER, max(bytes, (size_t)16), NULL, GL_STREAM_DRAW); //Orphan last frame's
+  if (bytes > 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+}
+
+//Gather the lights drawEntities found in view, bin them into the clusters and upload the result
+void binLights(LightClusters& lights){
+  lights.tilesX = (screenWidth + CLUSTER_TILE-1)/CLUSTER_TILE;
+  lights.tilesY = (screenHeight + CLUSTER_TILE-1)/CLUSTER_TILE;
+  lights.lights.clear();
+  for (size_t t = 0; t < drawLists.size(); t++){
+    lights.lights.insert(lights.lights.end(), drawLists[t].lights.begin(), drawLists[t].lights.end());
+  }
+  lights.bins.resize(lights.lights.size());
+  parallelFor(jobSystem, lights.lights.size(), 256, boundLightsJob, &lights);
+  int perSlice = lights.tilesX*lights.tilesY;
+  lights.grid.resize((size_t)perSlice*CLUSTER_SLICES*2);
+  lights.sliceIndices.resize(CLUSTER_SLICES);
+  parallelFor(jobSystem, CLUSTER_SLICES, 1, fillSlicesJob, &lights);
+  //Stitch the slices together
+  lights.indices.clear();
+  for (int z = 0; z < CLUSTER_SLICES; z++){
+    unsigned int base = lights.indices.size();
+    unsigned int* grid = &lights.grid[(size_t)z*perSlice*2];
+    for (int c = 0; c < perSlice; c++) grid[c*2] += base;
+    lights.indices.insert(lights.indices.end(), lights.sliceIndices[z].begin(), lights.sliceIndices[z].end());
+  }
+  uploadLightBuffer(lights.buffers[0], lights.lights.data(), lights.lights.size()*sizeof(LightGPU));
+  uploadLightBuffer(lights.buffers[1], lights.grid.data(), lights.grid.size()*sizeof(unsigned int));
+  uploadLightBuffer(lights.buffers[2], lights.indices.data(), lights.indices.size()*sizeof(unsigned int));
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  renderStats.lights += lights.lights.size();
+  renderStats.lightEntries += lights.indices.size();
+}
+
+//// Navigation ///////
+
+//Which open neighbour of a cell is closest to a goal (NAV_NONE at a goal, where there is no
+//way to one, or when the only way is into a goal that is closed)
+static inline int flowDirection(const NavGrid& grid, const FlowField& field, int c){
+  unsigned int best = field.dist[c];
+  if (best == 0 || best == NAV_UNREACHED) return NAV_NONE;
+  int w = grid.width, col = c % w, dir = NAV_NONE;
+  size_t cells = field.dist.size();
+  if (col+1 < w && grid.open[c+1] && field.dist[c+1] < best){ best = field.dist[c+1]; dir = NAV_EAST; }
+  if (col > 0 && grid.open[c-1] && field.dist[c-1] < best){ best = field.dist[c-1]; dir = NAV_WEST; }
+  if ((size_t)c+w < cells && grid.open[c+w] && field.dist[c+w] < best){ best = field.dist[c+w]; dir = NAV_NORTH; }
+  if (c >= w && grid.open[c-w] && field.dist[c-w] < best){ best = field.dist[c-w]; dir = NAV_SOUTH; }
+  return dir;
+}
+
+//Breadth first out from the goals, so every cell an agent can reach gets its step count to the
+//nearest one. The goals themselves don't have to be open (a closed door is a fine place to head for).
+//A field with a range only clears the cells its last flood reached and stops range steps out,
+//and points its cells here (pointFlowFields does the others, which cover the whole grid).
+static void floodFlowField(const NavGrid* grid, FlowField* field){
+  int w = grid->width;
+  size_t cells = (size_t)w*grid->height;
+  bool bounded = field->range != NAV_UNREACHED;
+  if (!bounded || field->dist.size() != cells){
+    field->dist.assign(cells, NAV_UNREACHED);
+    field->dir.assign(cells, NAV_NONE);
+  }
+  else {
+    for (size_t i = 0; i < field->reached.size(); i++){
+      field->dist[field->reached[i]] = NAV_UNREACHED;
+      field->dir[field->reached[i]] = NAV_NONE;
+    }
+  }
+  vector<int>& queue = field->reached; //Once it is done, the queue is every cell reached
+  queue.clear();
+  for (size_t g = 0; g < field->goals.size(); g++){
+    glm::ivec2 at = field->goals[g];
+    if (at.x < 0 || at.y < 0 || at.x >= w || at.y >= grid->height) continue;
+    int c = at.y*w + at.x;
+    if (field->dist[c] == 0) continue;
+    field->dist[c] = 0;
+    queue.push_back(c);
+  }
+  unsigned int* dist = field->dist.data();
+  const unsigned char* open = grid->open.data();
+  for (size_t q = 0; q < queue.size(); q++){
+    int c = queue[q], col = c % w;
+    unsigned int d = dist[c] + 1;
+    if (d > field->range) break; //Breadth first, so every cell after this one is as far out
+    if (col+1 < w && open[c+1] && dist[c+1] == NAV_UNREACHED){ dist[c+1] = d; queue.push_back(c+1); }
+    if (col > 0 && open[c-1] && dist[c-1] == NAV_UNREACHED){ dist[c-1] = d; queue.push_back(c-1); }
+    if ((size_t)c+w < cells && open[c+w] && dist[c+w] == NAV_UNREACHED){ dist[c+w] = d; queue.push_back(c+w); }
+    if (c >= w && open[c-w] && dist[c-w] == NAV_UNREACHED){ dist[c-w] = d; queue.push_back(c-w); }
+  }
+  if (!bounded) queue.clear();
+  else for (size_t q = 0; q < queue.size(); q++) field->dir[queue[q]] = flowDirection(*grid, *field, queue[q]);
+}
+
+//Point every cell of rows [firstRow, lastRow) of the fields downhill (fields with a range
+//were pointed by floodFlowField)
+static void pointFlowFields(const NavGrid* grid, FlowField* fields, int count, int firstRow, int lastRow){
+  for (int f = 0; f < count; f++){
+    if (fields[f].range != NAV_UNREACHED) continue;
+    for (int c = firstRow*grid->width; c < lastRow*grid->width; c++){
+      fields[f].dir[c] = flowDirection(*grid, fields[f], c);
+    }
+  }
+}
+
+//Rebuild fields toward their goals. Each field is flooded on its own thread, then the rows of
+//all of them are pointed in bands, numThreads at once.
+void buildFlowFields(const NavGrid& grid, FlowField* fields, int count, int numThreads){
+  vector<thread> workers;
+  for (int f = 1; f < count; f++) workers.push_back(thread(floodFlowField, &grid, &fields[f]));
+  if (count > 0) floodFlowField(&grid, &fields[0]);
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+  workers.clear();
+  int bands = max(1, min(numThreads, grid.height));
+  int rowsPerBand = (grid.height + bands-1)/bands;
+  for (int b = 1; b < bands; b++){
+    int first = b*rowsPerBand, last = min(grid.height, first+rowsPerBand);
+    if (first < last) workers.push_back(thread(pointFlowFields, &grid, fields, count, first, last));
+  }
+  pointFlowFields(&grid, fields, count, 0, min(grid.height, rowsPerBand));
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+}
+
+//The goals each field should have right now
+static void navigationGoals(const EntityStore& es, const Navigation& nav, int field, vector<glm::ivec2>& goals){
+  goals.clear();
+  if (field == NAV_CHASE && es.player >= 0 && es.active[es.player]){
+    goals.push_back(glm::ivec2((int)floor(es.col[es.player]+.5f), (int)floor(es.row[es.player]+.5f)));
+  }
+  if (field != NAV_OBJECTIVES) return;
+  for (size_t i = 0; i < nav.objectives.size(); i++){
+    int e = nav.objectives[i];
+    if (es.active[e]) goals.push_back(glm::ivec2((int)floor(es.col[e]+.5f), (int)floor(es.row[e]+.5f)));
+  }
+}
+
+static void navBuilder(Navigation* nav){
+  Uint64 start = SDL_GetPerformanceCounter();
+  //Fields that aren't being rebuilt are left out by packing the ones that are to the front
+  FlowField* toBuild[NUM_NAV_FIELDS];
+  int count = 0;
+  for (int f = 0; f < NUM_NAV_FIELDS; f++) if (nav->rebuilding[f]) toBuild[count++] = &nav->building[f];
+  if (count == NUM_NAV_FIELDS) buildFlowFields(nav->grid, nav->building, count, nav->numThreads);
+  else for (int f = 0; f < count; f++) buildFlowFields(nav->grid, toBuild[f], 1, nav->numThreads);
+  nav->lastBuildMs = elapsedMs(start);
+  nav->finished = true;
+}
+
+//Make a door's cell walkable and patch every field around it. Opening a door can only make
+//cells closer to a goal, so this is a breadth first search out from the door that stops
+//wherever nothing got closer (or at a field's range), then re-pointing the cells that changed
+//and their neighbours.
+static void openNavCell(Navigation& nav, int c){
+  NavGrid& grid = nav.grid;
+  grid.open[c] = 1;
+  int w = grid.width;
+  static vector<int> queue;
+  for (int f = 0; f < NUM_NAV_FIELDS; f++){
+    FlowField& field = nav.fields[f];
+    if (field.dist.empty()) continue;
+    size_t cells = field.dist.size();
+    unsigned int* dist = field.dist.data();
+    int col = c % w;
+    unsigned int best = dist[c];
+    if (col+1 < w && dist[c+1] != NAV_UNREACHED) best = min(best, dist[c+1]+1);
+    if (col > 0 && dist[c-1] != NAV_UNREACHED) best = min(best, dist[c-1]+1);
+    if ((size_t)c+w < cells && dist[c+w] != NAV_UNREACHED) best = min(best, dist[c+w]+1);
+    if (c >= w && dist[c-w] != NAV_UNREACHED) best = min(best, dist[c-w]+1);
+    if (best != NAV_UNREACHED && best > field.range) best = NAV_UNREACHED;
+    bool bounded = field.range != NAV_UNREACHED;
+    queue.clear();
+    queue.push_back(c); //Re-point it even if it got no closer, it might be a goal that just opened
+    if (bounded && dist[c] == NAV_UNREACHED && best != NAV_UNREACHED) field.reached.push_back(c);
+    dist[c] = best;
+    for (size_t q = 0; q < queue.size() && best != NAV_UNREACHED; q++){
+      int n = queue[q], ncol = n % w;
+      unsigned int d = dist[n] + 1;
+      if (d > field.range) continue;
+      int next[4] = {ncol+1 < w ? n+1 : -1, ncol > 0 ? n-1 : -1, (size_t)n+w < cells ? n+w : -1, n >= w ? n-w : -1};
+      for (int k = 0; k < 4; k++){
+        int m = next[k];
+        if (m < 0 || !grid.open[m] || d >= dist[m]) continue;
+        if (bounded && dist[m] == NAV_UNREACHED) field.reached.push_back(m);
+        dist[m] = d;
+        queue.push_back(m);
+      }
+    }
+    for (size_t q = 0; q < queue.size(); q++){
+      int n = queue[q], ncol = n % w;
+      field.dir[n] = flowDirection(grid, field, n);
+      if (ncol+1 < w) field.dir[n+1] = flowDirection(grid, field, n+1);
+      if (ncol > 0) field.dir[n-1] = flowDirection(grid, field, n-1);
+      if ((size_t)n+w < cells) field.dir[n+w] = flowDirection(grid, field, n+w);
+      if (n >= w) field.dir[n-w] = flowDirection(grid, field, n-w);
+    }
+  }
+}
+
+//A door opened (see triggerEntities). It is patched into the grid and fields on the next update.
+void navDoorOpened(Navigation& nav, int row, int col){
+  if (nav.grid.open.empty()) return;
+  nav.openedDoors.push_back(row*nav.grid.width + col);
+}
+
+//Apply the doors that have opened since the grid was last patched. Not while the builder is
+//reading the grid, they wait for it to finish.
+int openNavCells(Navigation& nav){
+  int opened = 0;
+  for (size_t i = 0; i < nav.openedDoors.size(); i++){
+    int c = nav.openedDoors[i];
+    if (nav.grid.open[c]) continue;
+    openNavCell(nav, c);
+    opened++;
+  }
+  nav.openedDoors.clear();
+  nav.doorUpdates += opened;
+  return opened;
+}
+
+//New level: the grid is rebuilt from it (es has the doors), and the fields will be on the next tick
+void resetNavigation(Navigation& nav, const Level& level, const EntityStore& es){
+  stopNavigation(nav);
+  nav.numThreads = max(1, SDL_GetCPUCount());
+  nav.grid.width = level.width;
+  nav.grid.height = level.height;
+  nav.grid.open.assign((size_t)level.width*level.height, 0);
+  for (int row = 0; row < level.height; row++){
+    for (int col = 0; col < level.width; col++){
+      nav.grid.open[(size_t)row*level.width + col] = !cellSolid(level, es, row, col);
+    }
+  }
+  for (int f = 0; f < NUM_NAV_FIELDS; f++){
+    nav.fields[f] = FlowField();
+    nav.building[f] = FlowField();
+    nav.fields[f].range = nav.building[f].range = f == NAV_CHASE ? NAV_CHASE_RANGE : NAV_UNREACHED;
+    nav.agents[f].clear();
+  }
+  //The store only changes size when it is spawned again, which comes back through here
+  nav.objectives.clear();
+  nav.openedDoors.clear();
+  for (int e = 0; e < es.count(); e++){
+    if (es.kind[e] == ENTITY_AGENT) nav.agents[es.navField[e]].push_back(e);
+    if (es.kind[e] == ENTITY_KEY || es.kind[e] == ENTITY_DOOR) nav.objectives.push_back(e);
+  }
+}
+
+//Once a tick: swap in whatever the builder finished, patch in opened doors and start
+//rebuilding any field whose goals have moved. Only fields that agents follow are kept up.
+void updateNavigation(Navigation& nav, const EntityStore& es){
+  if (nav.busy){
+    if (!nav.finished) return;
+    nav.builder.join();
+    nav.busy = false;
+    nav.builds++;
+    for (int f = 0; f < NUM_NAV_FIELDS; f++) if (nav.rebuilding[f]) swap(nav.fields[f], nav.building[f]);
+  }
+  if (nav.grid.open.empty()) return;
+  openNavCells(nav);
+  bool any = false;
+  for (int f = 0; f < NUM_NAV_FIELDS; f++){
+    nav.rebuilding[f] = false;
+    bool chasersNeedIt = f == NAV_OBJECTIVES && !nav.agents[NAV_CHASE].empty(); //Out of range fallback
+    if (nav.agents[f].empty() && !chasersNeedIt) continue;
+    navigationGoals(es, nav, f, nav.building[f].goals);
+    if (!nav.fields[f].dist.empty() && nav.building[f].goals == nav.fields[f].goals) continue;
+    nav.rebuilding[f] = any = true;
+  }
+  if (!any) return;
+  nav.busy = true;
+  nav.finished = false;
+  nav.builder = thread(navBuilder, &nav);
+}
+
+void stopNavigation(Navigation& nav){
+  if (nav.busy) nav.builder.join();
+  nav.busy = false;
+}
+
+//Every agent takes a step toward the center of the cell its field points to. Agents stay on
+//open cells this way, so they don't need to collide with the level.
+void steerAgents(EntityStore& es, const Navigation& nav){
+  static const int stepCol[5] = {0, 1, -1, 0, 0}, stepRow[5] = {0, 0, 0, 1, -1};
+  float step = agentSpeed * TICK_SECONDS;
+  int w = nav.grid.width;
+  const FlowField& fallback = nav.fields[NAV_OBJECTIVES];
+  for (int f = 0; f < NUM_NAV_FIELDS; f++){
+    const FlowField& field = nav.fields[f];
+    for (size_t a = 0; a < nav.agents[f].size(); a++){
+      int e = nav.agents[f][a];
+      if (!es.active[e]) continue;
+      int col = (int)floor(es.col[e]+.5f), row = (int)floor(es.row[e]+.5f);
+      size_t c = (size_t)row*w + col;
+      //Chasers too far from the player (or before the first chase field) go for the objectives
+      bool chase = !field.dir.empty() && field.dist[c] != NAV_UNREACHED;
+      const FlowField& follow = chase || f != NAV_CHASE ? field : fallback;
+      if (follow.dir.empty()) continue;
+      int dir = follow.dir[c];
+      glm::vec2 to(col + stepCol[dir] - es.col[e], row + stepRow[dir] - es.row[e]);
+      float length = sqrt(to.x*to.x + to.y*to.y);
+      if (length > step) to = to * (step/length);
+      es.moveCol[e] += to.x;
+      es.moveRow[e] += to.y;
+    }
+  }
+}
+
+//-navbench: how long the fields take to build and to patch, and what the agents cost per tick
+bool benchmarkNavigation(const char* mapFile, int agents){
+  agentCount = agents;
+  if (!loadLevel(mapFile, level)) return false;
+  EntityStore& es = entities;
+  int spawned = 0;
+  for (int e = 0; e < es.count(); e++) if (es.kind[e] == ENTITY_AGENT) spawned++;
+  printf("Navigation benchmark: %s (%dx%d cells), %d agents, %d threads\n", mapFile, level.width, level.height,
+         spawned, nav.numThreads);
+
+  //Full builds, both fields at once as the builder does them, and single threaded for comparison
+  for (int f = 0; f < NUM_NAV_FIELDS; f++) navigationGoals(es, nav, f, nav.fields[f].goals);
+  Uint64 start = SDL_GetPerformanceCounter();
+  buildFlowFields(nav.grid, nav.fields, NUM_NAV_FIELDS, nav.numThreads);
+  double buildMs = elapsedMs(start);
+  FlowField single[NUM_NAV_FIELDS];
+  for (int f = 0; f < NUM_NAV_FIELDS; f++){
+    single[f].goals = nav.fields[f].goals;
+    single[f].range = nav.fields[f].range;
+  }
+  start = SDL_GetPerformanceCounter();
+  for (int f = 0; f < NUM_NAV_FIELDS; f++) buildFlowFields(nav.grid, &single[f], 1, 1);
+  double singleMs = elapsedMs(start);
+  bool same = true;
+  for (int f = 0; f < NUM_NAV_FIELDS; f++) same = same && single[f].dir == nav.fields[f].dir;
+  printf("  build %d fields: %.2f ms (%.2f ms on one thread, %s)\n", NUM_NAV_FIELDS, buildMs, singleMs,
+         same ? "same fields" : "FIELDS DIFFER");
+
+  //Agents, with the fields held still
+  const int ticks = 240;
+  start = SDL_GetPerformanceCounter();
+  for (int t = 0; t < ticks; t++){
+    steerAgents(es, nav);
+    moveEntities(es);
+  }
+  double tickMs = elapsedMs(start)/ticks;
+  printf("  steer and move agents: %.3f ms per tick, %.1f ns per agent\n", tickMs, tickMs*1e6/max(1, spawned));
+
+  //The chase field following the player a cell at a time, against flooding the whole grid
+  if (!nav.fields[NAV_CHASE].goals.empty()){
+    FlowField whole;
+    whole.goals = nav.fields[NAV_CHASE].goals;
+    start = SDL_GetPerformanceCounter();
+    buildFlowFields(nav.grid, &whole, 1, 1);
+    double wholeMs = elapsedMs(start);
+    const int moves = 100;
+    glm::ivec2 at = nav.fields[NAV_CHASE].goals[0];
+    start = SDL_GetPerformanceCounter();
+    for (int m = 0; m < moves; m++){
+      nav.fields[NAV_CHASE].goals[0] = glm::ivec2(at.x + (m&1), at.y);
+      buildFlowFields(nav.grid, &nav.fields[NAV_CHASE], 1, 1);
+    }
+    double chaseMs = elapsedMs(start)/moves;
+    printf("  chase field within %u steps: %.3f ms per player move (%.2f ms for the whole grid)\n", NAV_CHASE_RANGE,
+           chaseMs, wholeMs);
+  }
+
+  //Open every door: patched in place against rebuilding from scratch
+  int doors = 0;
+  for (int e = 0; e < es.count(); e++){
+    if (es.kind[e] == ENTITY_DOOR && es.active[e]){
+      es.active[e] = 0;
+      navDoorOpened(nav, (int)es.row[e], (int)es.col[e]);
+      doors++;
+    }
+  }
+  if (doors > 0){
+    start = SDL_GetPerformanceCounter();
+    openNavCells(nav);
+    double patchMs = elapsedMs(start);
+    for (int f = 0; f < NUM_NAV_FIELDS; f++) single[f].goals = nav.fields[f].goals;
+    start = SDL_GetPerformanceCounter();
+    buildFlowFields(nav.grid, single, NUM_NAV_FIELDS, nav.numThreads);
+    double rebuildMs = elapsedMs(start);
+    same = true;
+    for (int f = 0; f < NUM_NAV_FIELDS; f++) same = same && single[f].dist == nav.fields[f].dist;
+    printf("  open %d doors: %.3f ms patched, %.2f ms rebuilt (%s)\n", doors, patchMs, rebuildMs,
+           same ? "same distances" : "DISTANCES DIFFER");
+  }
+  stopNavigation(nav);
+  unloadLevel(level);
+  return true;
+}
+
+//// Potentially Visible Sets ///////
+
+static void pvsMark(CellPVS& pvs, int dRow, int dCol){
+  int bit = (dRow+PVS_RADIUS)*PVS_SPAN + (dCol+PVS_RADIUS);
+  pvs.bits[bit>>5] |= 1u << (bit&31);
+}
+
+//Cast PVS_RAYS rays from the center and the four corners of the cell, walking the grid with a
+//DDA (Amanatides & Woo) until a ray leaves the window or hits something opaque
+static void computeCellPVS(const Level& level, int row, int col, CellPVS& pvs){
+  memset(pvs.bits, 0, sizeof(pvs.bits));
+  pvsMark(pvs, 0, 0);
+  const float samples[5][2] = {{0,0}, {-.45f,-.45f}, {.45f,-.45f}, {-.45f,.45f}, {.45f,.45f}};
+  for (int s = 0; s < 5; s++){
+    //Grid coordinates where cell (row, col) covers [col, col+1) x [row, row+1)
+    float ox = col + 0.5f + samples[s][0], oy = row + 0.5f + samples[s][1];
+    for (int r = 0; r < PVS_RAYS; r++){
+      float angle = (r + 0.5f) * 2*3.14159265f/PVS_RAYS;
+      float dx = cos(angle), dy = sin(angle);
+      int cx = col, cy = row;
+      int stepX = dx > 0 ? 1 : -1, stepY = dy > 0 ? 1 : -1;
+      float tDeltaX = fabs(1/dx), tDeltaY = fabs(1/dy);
+      float tMaxX = (dx > 0 ? (cx+1 - ox) : (ox - cx)) * tDeltaX;
+      float tMaxY = (dy > 0 ? (cy+1 - oy) : (oy - cy)) * tDeltaY;
+      while (true){
+        if (tMaxX < tMaxY){ cx += stepX; tMaxX += tDeltaX; }
+        else              { cy += stepY; tMaxY += tDeltaY; }
+        if (abs(cx-col) > PVS_RADIUS || abs(cy-row) > PVS_RADIUS) break;
+        pvsMark(pvs, cy-row, cx-col);
+        if (cellSolid(level, entities, cy, cx)) break;
+      }
+    }
+  }
+}
+
+//The PVS of a resident cell, computing it on first use. Returns NULL (no PVS culling) if
+//the cell isn't resident.
+const CellPVS* levelPVS(Level& level, glm::ivec2 cell){
+  if (cell.x < 0 || cell.y < 0 || cell.x >= level.width || cell.y >= level.height) return NULL;
+  unordered_map<int,int>::const_iterator it = level.slotOf.find((cell.y/CHUNK_SIZE)*level.chunksX + cell.x/CHUNK_SIZE);
+  if (it == level.slotOf.end()) return NULL;
+  MapChunk& chunk = level.chunks[it->second];
+  int local = (cell.y%CHUNK_SIZE)*CHUNK_SIZE + cell.x%CHUNK_SIZE;
+  if (chunk.pvs.empty()) chunk.pvs.resize(CHUNK_SIZE*CHUNK_SIZE);
+  if (!chunk.pvsDone[local]){
+    computeCellPVS(level, cell.y, cell.x, chunk.pvs[local]);
+    chunk.pvsDone[local] = true;
+  }
+  return &chunk.pvs[local];
+}
+
+//The door at (row, col) opened or closed. Only cells whose rays reached the door (it is in their
+//PVS, like any cell that stops a ray) can see differently now, so only their PVSes go.
+void pvsDoorChanged(Level& level, int row, int col){
+  for (size_t c = 0; c < level.chunks.size(); c++){
+    MapChunk& chunk = level.chunks[c];
+    if (chunk.pvs.empty()) continue;
+    for (int local = 0; local < CHUNK_SIZE*CHUNK_SIZE; local++){
+      if (!chunk.pvsDone[local]) continue;
+      glm::ivec2 center(chunk.cx*CHUNK_SIZE + local%CHUNK_SIZE, chunk.cy*CHUNK_SIZE + local/CHUNK_SIZE);
+      if (pvsVisible(&chunk.pvs[local], center, row, col)) chunk.pvsDone[local] = false;
+    }
+  }
+}
+
+//Is cell (row, col) in the PVS of the cell at center?
+bool pvsVisible(const CellPVS* pvs, glm::ivec2 center, int row, int col){
+  int dRow = row - center.y, dCol = col - center.x;
+  if (abs(dRow) > PVS_RADIUS || abs(dCol) > PVS_RADIUS) return false;
+  int bit = (dRow+PVS_RADIUS)*PVS_SPAN + (dCol+PVS_RADIUS);
+  return (pvs->bits[bit>>5] >> (bit&31)) & 1;
+}
+
+//Put a chunk in a resident slot and build its mesh
+static void pageInChunk(Level& level, int cx, int cy, MapChunk& chunk){
+  chunk.cx = cx;
+  chunk.cy = cy;
+  chunk.visible = true;
+  chunk.pvsDone.assign(CHUNK_SIZE*CHUNK_SIZE, false);
+  buildChunkMesh(level, chunk);
+}
+
+//Make every chunk within CHUNK_STREAM_RADIUS of the player's chunk resident, evicting the
+//chunks farthest from the player once the budget is used up. Cheap when the player hasn't
+//crossed into a new chunk.
+void streamLevel(Level& level, glm::ivec2 playerCell){
+  int px = max(0, min(playerCell.x, level.width-1))/CHUNK_SIZE;
+  int py = max(0, min(playerCell.y, level.height-1))/CHUNK_SIZE;
+  if (px == level.streamCenter.x && py == level.streamCenter.y) return;
+  level.streamCenter = glm::ivec2(px, py);
+  for (int cy = max(0, py-CHUNK_STREAM_RADIUS); cy <= min(level.chunksY-1, py+CHUNK_STREAM_RADIUS); cy++){
+    for (int cx = max(0, px-CHUNK_STREAM_RADIUS); cx <= min(level.chunksX-1, px+CHUNK_STREAM_RADIUS); cx++){
+      int index = cy*level.chunksX + cx;
+      if (level.slotOf.count(index)) continue;
+      int slot;
+      if ((int)level.chunks.size() < CHUNK_BUDGET){
+        level.chunks.push_back(MapChunk());
+        slot = level.chunks.size()-1;
+      }
+      else { //Evict the farthest chunk, it is outside the radius since the budget covers it
+        slot = 0;
+        int farthest = -1;
+        for (size_t c = 0; c < level.chunks.size(); c++){
+          int d = max(abs(level.chunks[c].cx-px), abs(level.chunks[c].cy-py));
+          if (d > farthest){
+            farthest = d;
+            slot = c;
+          }
+        }
+        level.slotOf.erase(level.chunks[slot].cy*level.chunksX + level.chunks[slot].cx);
+        level.pageOuts++;
+      }
+      pageInChunk(level, cx, cy, level.chunks[slot]);
+      level.slotOf[index] = slot;
+      level.pageIns++;
+      level.meshDirty = true;
+    }
+  }
+}
+
+//The cell the player (the knot) is standing in
+glm::ivec2 playerCell(){
+  int p = entities.player;
+  if (p < 0) return level.spawn;
+  return glm::ivec2((int)floor(entities.col[p]+0.5f), (int)floor(entities.row[p]+0.5f));
+}
+
+//Write a random maze (recursive backtracker) as a text map, for trying out very large levels.
+//The player starts in the bottom left corner and the key is in the top right.
+bool generateMaze(int width, int height, const char* fileName){
+  if (width < 3 || height < 3){
+    printf("Maze must be at least 3x3\n");
+    return false;
+  }
+  vector<unsigned char> cells((size_t)width*height, CELL_WALL);
+  vector<glm::ivec2> stack;
+  stack.push_back(glm::ivec2(1,1));
+  cells[width+1] = CELL_FLOOR;
+  const int dx[4] = {2,-2,0,0}, dy[4] = {0,0,2,-2};
+  while (!stack.empty()){
+    glm::ivec2 c = stack.back();
+    int options[4], numOptions = 0;
+    for (int d = 0; d < 4; d++){
+      int x = c.x+dx[d], y = c.y+dy[d];
+      if (x > 0 && y > 0 && x < width-1 && y < height-1 && cells[(size_t)y*width+x] == CELL_WALL) options[numOptions++] = d;
+    }
+    if (numOptions == 0){
+      stack.pop_back();
+      continue;
+    }
+    int d = options[rand()%numOptions];
+    cells[(size_t)(c.y+dy[d]/2)*width + c.x+dx[d]/2] = CELL_FLOOR;
+    cells[(size_t)(c.y+dy[d])*width + c.x+dx[d]] = CELL_FLOOR;
+    stack.push_back(glm::ivec2(c.x+dx[d], c.y+dy[d]));
+  }
+  int lastX = (width-2) - (width-2+1)%2, lastY = (height-2) - (height-2+1)%2; //Last odd cell
+  cells[(size_t)lastY*width + 1] = CELL_SPAWN;
+  cells[(size_t)width + lastX] = CELL_KEY_PLATE;
+
+  FILE* fp = fopen(fileName, "w");
+  if (fp == NULL){
+    printf("can't write maze %s\n", fileName);
+    return false;
+  }
+  fprintf(fp, "%d %d\n", width, height);
+  string line;
+  for (int i = 0; i < height; i++){
+    line.clear();
+    for (int j = 0; j < width; j++){
+      line += (char)('0' + cells[(size_t)i*width+j]);
+      line += (j+1 < width) ? ' ' : '\n';
+    }
+    fputs(line.c_str(), fp);
+  }
+  fclose(fp);
+  printf("Wrote %dx%d maze to %s\n", width, height, fileName);
+  return true;
+}
+
+//Hot reload: on Linux we ask inotify to tell us when the map file is rewritten, so checking
+//for changes each frame is a single non-blocking read() with no disk access. Elsewhere we
+//fall back to checking the file's modification time about once a second.
+#if defined(__linux__)
+static int levelWatchFd = -1;
+static string levelWatchName;
+void watchLevelFile(const char* fileName){
+  levelWatchFd = inotify_init1(IN_NONBLOCK);
+  if (levelWatchFd < 0){
+    printf("inotify unavailable, map hot reload disabled\n");
+    return;
+  }
+  //Watch the directory rather than the file, editors often save by renaming a new file over it
+  string path = fileName;
+  size_t slash = path.rfind('/');
+  string dir = (slash == string::npos) ? "." : path.substr(0, slash);
+  levelWatchName = (slash == string::npos) ? path : path.substr(slash+1);
+  if (inotify_add_watch(levelWatchFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+    close(levelWatchFd);
+    levelWatchFd = -1;
+  }
+}
+bool levelFileChanged(){
+  if (levelWatchFd < 0) return false;
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t len;
+  while ((len = read(levelWatchFd, buffer, sizeof(buffer))) > 0){
+    for (char* ptr = buffer; ptr < buffer + len; ){
+      const struct inotify_event* event = (const struct inotify_event*)ptr;
+      if (event->len > 0 && levelWatchName == event->name) changed = true;
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+#else
+static string levelWatchName;
+static long long levelWatchTime = -1;
+static Uint32 levelWatchLastCheck = 0;
+void watchLevelFile(const char* fileName){
+  levelWatchName = fileName;
+  levelWatchTime = fileModTime(fileName);
+}
+bool levelFileChanged(){
+  if (SDL_GetTicks() - levelWatchLastCheck < 1000) return false;
+  levelWatchLastCheck = SDL_GetTicks();
+  long long t = fileModTime(levelWatchName.c_str());
+  if (t == levelWatchTime) return false;
+  levelWatchTime = t;
+  return true;
+}
+#endif
+
+// Create a NULL-terminated string by reading the provided file
+static char* readShaderSource(const char* shaderFile){
+	FILE *fp;
+	long length;
+	char *buffer;
+
+	// open the file containing the text of the shader code
 	fp = fopen(shaderFile, "r");
 
 	// check for errors in opening the file
@@ -862,6 +4524,507 @@ static char* readShaderSource(const char* shaderFile){
 	return buffer;
 }
 
+//readShaderSource, with each #include "file" line replaced by that file's source. Declarations
+//every program has to agree on (the std140 blocks that mirror FrameUniforms and
+//MeshDecodeUniforms) live in one file each this way.
+static char* readShaderWithIncludes(const char* shaderFile){
+	char* text = readShaderSource(shaderFile);
+	if (text == NULL || strstr(text, "#include") == NULL) return text;
+	string source;
+	for (const char* line = text; *line; ){
+		const char* end = strchr(line, '\n');
+		end = end ? end+1 : line + strlen(line);
+		const char* open = strncmp(line, "#include \"", 10) == 0 ? line + 10 : NULL;
+		const char* close = open ? strchr(open, '"') : NULL;
+		if (close && close < end){
+			string name(open, close);
+			char* included = readShaderWithIncludes(name.c_str());
+			if (included == NULL){
+				printf("%s: can't include %s\n", shaderFile, name.c_str());
+				delete[] text;
+				return NULL;
+			}
+			source += included;
+			source += '\n';
+			delete[] included;
+		}
+		else source.append(line, end);
+		line = end;
+	}
+	delete[] text;
+	char* buffer = new char[source.size() + 1];
+	memcpy(buffer, source.c_str(), source.size() + 1);
+	return buffer;
+}
+
+//// Materials ///////
+
+//"wood.bmp" -> "wood.tex"
+static string textureCacheName(const char* bmpFileName){
+  string name = bmpFileName;
+  size_t dot = name.rfind('.');
+  if (dot != string::npos) name = name.substr(0, dot);
+  return name + ".tex";
+}
+
+//Bilinearly rescale a 3 byte per pixel (BGR) image to size x size BGRA
+static void resampleToBGRA(const unsigned char* src, int srcW, int srcH, int srcPitch, unsigned char* dst, int size){
+  for (int y = 0; y < size; y++){
+    float sy = max(0.f, (y + 0.5f)*srcH/size - 0.5f);
+    int y0 = min((int)sy, srcH-1), y1 = min(y0+1, srcH-1);
+    float fy = sy - y0;
+    for (int x = 0; x < size; x++){
+      float sx = max(0.f, (x + 0.5f)*srcW/size - 0.5f);
+      int x0 = min((int)sx, srcW-1), x1 = min(x0+1, srcW-1);
+      float fx = sx - x0;
+      for (int c = 0; c < 3; c++){
+        float top = src[y0*srcPitch + x0*3 + c]*(1-fx) + src[y0*srcPitch + x1*3 + c]*fx;
+        float bottom = src[y1*srcPitch + x0*3 + c]*(1-fx) + src[y1*srcPitch + x1*3 + c]*fx;
+        dst[(y*size + x)*4 + c] = (unsigned char)(top*(1-fy) + bottom*fy + 0.5f);
+      }
+      dst[(y*size + x)*4 + 3] = 255;
+    }
+  }
+}
+
+//Next mip level down: average each 2x2 block of a size x size BGRA image
+static void downsampleBGRA(const unsigned char* src, int size, unsigned char* dst){
+  int half = max(size/2, 1);
+  for (int y = 0; y < half; y++){
+    for (int x = 0; x < half; x++){
+      int x0 = min(2*x, size-1), x1 = min(2*x+1, size-1), y0 = min(2*y, size-1), y1 = min(2*y+1, size-1);
+      for (int c = 0; c < 4; c++){
+        int sum = src[(y0*size + x0)*4 + c] + src[(y0*size + x1)*4 + c] + src[(y1*size + x0)*4 + c] + src[(y1*size + x1)*4 + c];
+        dst[(y*half + x)*4 + c] = (sum + 2)/4;
+      }
+    }
+  }
+}
+
+static unsigned short packRGB565(const int bgr[3]){
+  return ((bgr[2]>>3)<<11) | ((bgr[1]>>2)<<5) | (bgr[0]>>3);
+}
+
+static void unpackRGB565(unsigned short c, int bgr[3]){
+  bgr[2] = ((c>>11)&31)*255/31;
+  bgr[1] = ((c>>5)&63)*255/63;
+  bgr[0] = (c&31)*255/31;
+}
+
+//Compress a size x size BGRA level to BC1. The endpoints of each block are the corners of its
+//color bounding box (pulled in a little, like stb_dxt), every pixel gets the nearest of the 4 colors.
+static void compressBC1(const unsigned char* src, int size, vector<unsigned char>& out){
+  int blocks = (size+3)/4;
+  out.resize(blocks*blocks*8);
+  for (int by = 0; by < blocks; by++){
+    for (int bx = 0; bx < blocks; bx++){
+      const unsigned char* px[16];
+      int lo[3] = {255,255,255}, hi[3] = {0,0,0};
+      for (int i = 0; i < 16; i++){ //Levels smaller than a block repeat their edge pixels
+        px[i] = src + (min(by*4 + i/4, size-1)*size + min(bx*4 + i%4, size-1))*4;
+        for (int c = 0; c < 3; c++){
+          lo[c] = min(lo[c], (int)px[i][c]);
+          hi[c] = max(hi[c], (int)px[i][c]);
+        }
+      }
+      for (int c = 0; c < 3; c++){
+        int inset = (hi[c]-lo[c])/16;
+        lo[c] += inset;
+        hi[c] -= inset;
+      }
+      unsigned short c0 = packRGB565(hi), c1 = packRGB565(lo);
+      if (c0 < c1) swap(c0, c1); //c0 > c1 selects the 4 color mode
+      int palette[4][3];
+      unpackRGB565(c0, palette[0]);
+      unpackRGB565(c1, palette[1]);
+      for (int c = 0; c < 3; c++){
+        palette[2][c] = (2*palette[0][c] + palette[1][c])/3;
+        palette[3][c] = (palette[0][c] + 2*palette[1][c])/3;
+      }
+      unsigned int bits = 0;
+      if (c0 != c1){ //Otherwise every pixel is color 0
+        for (int i = 0; i < 16; i++){
+          int best = 0, bestDist = 1<<30;
+          for (int p = 0; p < 4; p++){
+            int d = 0;
+            for (int c = 0; c < 3; c++) d += (px[i][c]-palette[p][c])*(px[i][c]-palette[p][c]);
+            if (d < bestDist){
+              bestDist = d;
+              best = p;
+            }
+          }
+          bits |= best << (2*i);
+        }
+      }
+      unsigned char* block = &out[(by*blocks + bx)*8];
+      block[0] = c0 & 0xFF; block[1] = c0 >> 8;
+      block[2] = c1 & 0xFF; block[3] = c1 >> 8;
+      for (int b = 0; b < 4; b++) block[4+b] = (bits >> (8*b)) & 0xFF;
+    }
+  }
+}
+
+//Bytes in one mip level of a cooked texture
+static size_t textureLevelBytes(int format, int size){
+  if (format == TEXTURE_BC1) return (size_t)((size+3)/4)*((size+3)/4)*8;
+  return (size_t)size*size*4;
+}
+
+//Load a BMP, rescale it to MATERIAL_SIZE, build its mip chain and write it out as a *.tex file.
+//Catches unreadable or empty images here rather than when the game starts.
+bool cookTexture(const char* bmpFileName, int format){
+  Uint64 start = SDL_GetPerformanceCounter();
+  SDL_Surface* loaded = SDL_LoadBMP(bmpFileName);
+  if (loaded == NULL || loaded->w <= 0 || loaded->h <= 0){
+    printf("can't cook texture %s: \"%s\"\n", bmpFileName, loaded == NULL ? SDL_GetError() : "image is empty");
+    if (loaded != NULL) SDL_FreeSurface(loaded);
+    return false;
+  }
+  SDL_Surface* surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_BGR24, 0);
+  SDL_FreeSurface(loaded);
+  if (surface == NULL){
+    printf("can't cook texture %s: \"%s\"\n", bmpFileName, SDL_GetError());
+    return false;
+  }
+
+  TextureCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "TEXC", 4);
+  header.version = TEXTURE_CACHE_VERSION;
+  header.format = format;
+  header.size = MATERIAL_SIZE;
+  header.sourceWidth = surface->w;
+  header.sourceHeight = surface->h;
+  for (int size = MATERIAL_SIZE; size >= 1; size /= 2) header.numLevels++;
+
+  //Each level is made from the full color one above it, then compressed on its own
+  vector<unsigned char> level(MATERIAL_SIZE*MATERIAL_SIZE*4), next(level.size()), data, compressed;
+  resampleToBGRA((const unsigned char*)surface->pixels, surface->w, surface->h, surface->pitch, &level[0], MATERIAL_SIZE);
+  SDL_FreeSurface(surface);
+  for (int l = 0, size = MATERIAL_SIZE; l < header.numLevels; l++, size /= 2){
+    if (format == TEXTURE_BC1){
+      compressBC1(&level[0], size, compressed);
+      data.insert(data.end(), compressed.begin(), compressed.end());
+    }
+    else data.insert(data.end(), level.begin(), level.begin() + textureLevelBytes(format, size));
+    if (size > 1){
+      downsampleBGRA(&level[0], size, &next[0]);
+      level.swap(next);
+    }
+  }
+  header.cookMs = (float)elapsedMs(start);
+
+  string cacheFileName = textureCacheName(bmpFileName);
+  FILE* fp = fopen(cacheFileName.c_str(), "wb");
+  if (fp == NULL){
+    printf("can't write texture cache %s\n", cacheFileName.c_str());
+    return false;
+  }
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(data.data(), 1, data.size(), fp);
+  fclose(fp);
+  printf("Cooked %s -> %s (%dx%d -> %d, %d levels, %s, %.2f ms)\n", bmpFileName, cacheFileName.c_str(), header.sourceWidth,
+         header.sourceHeight, header.size, header.numLevels, format == TEXTURE_BC1 ? "BC1" : "BGRA8", header.cookMs);
+  return true;
+}
+
+static bool validTextureCache(const void* base, size_t length, int format){
+  const TextureCacheHeader* h = (const TextureCacheHeader*)base;
+  if (memcmp(h->magic, "TEXC", 4) != 0 || h->version != TEXTURE_CACHE_VERSION) return false;
+  if (h->format != format || h->size != MATERIAL_SIZE) return false;
+  size_t bytes = sizeof(TextureCacheHeader);
+  int size = h->size;
+  for (int l = 0; l < h->numLevels; l++, size = max(size/2, 1)) bytes += textureLevelBytes(format, size);
+  return size == 1 && length >= bytes;
+}
+
+//Map a texture's cooked file, cooking it first if it is missing, stale or in the wrong format
+static bool mapTextureCache(const char* bmpFileName, int format, void*& base, size_t& length){
+  string cacheFileName = textureCacheName(bmpFileName);
+  long long bmpTime = fileModTime(bmpFileName);
+  long long cacheTime = fileModTime(cacheFileName.c_str());
+  bool cooked = false;
+  if (cacheTime < 0 || bmpTime > cacheTime){
+    if (!cookTexture(bmpFileName, format)) return false;
+    cooked = true;
+  }
+  if (mapFile(cacheFileName.c_str(), sizeof(TextureCacheHeader), base, length) && validTextureCache(base, length, format)) return true;
+  unmapFile(base, length);
+  if (cooked || !cookTexture(bmpFileName, format)) return false;
+  return mapFile(cacheFileName.c_str(), sizeof(TextureCacheHeader), base, length) && validTextureCache(base, length, format);
+}
+
+static bool hasGLExtension(const char* name){
+  GLint count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (int i = 0; i < count; i++){
+    if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+  }
+  return false;
+}
+
+//Allocate the texture array for count cooked textures (see cookTexture), bound to
+//MATERIAL_UNIT. Every layer starts out as a flat grey placeholder: only the 1x1 mip level is
+//filled in and used (GL_TEXTURE_BASE_LEVEL) until the asset loader has uploaded them all.
+GLuint createMaterialArray(int count){
+  if (compressTextures && !hasGLExtension("GL_EXT_texture_compression_s3tc")){
+    printf("No S3TC support, using uncompressed textures\n");
+    compressTextures = false;
+  }
+  int format = compressTextures ? TEXTURE_BC1 : TEXTURE_BGRA8;
+
+  GLuint tex;
+  glGenTextures(1, &tex);
+  glActiveTexture(GL_TEXTURE0 + MATERIAL_UNIT);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+  //What to do outside 0-1 range (repeat, the merged floor and wall faces tile it once per cell)
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  int numLevels = 0;
+  for (int size = MATERIAL_SIZE; size >= 1; size /= 2, numLevels++){
+    if (format == TEXTURE_BC1){
+      glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, numLevels, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, size, size, count, 0,
+                             textureLevelBytes(format, size)*count, NULL);
+    }
+    else glTexImage3D(GL_TEXTURE_2D_ARRAY, numLevels, GL_RGBA8, size, size, count, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+  }
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, numLevels-1);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, numLevels-1);
+
+  const unsigned char grey[4] = {160, 160, 160, 255};
+  vector<unsigned char> placeholder;
+  if (format == TEXTURE_BC1) compressBC1(grey, 1, placeholder);
+  else placeholder.assign(grey, grey+4);
+  vector<unsigned char> layers;
+  for (int i = 0; i < count; i++) layers.insert(layers.end(), placeholder.begin(), placeholder.end());
+  if (format == TEXTURE_BC1){
+    glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, numLevels-1, 0, 0, 0, 1, 1, count, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, layers.size(), &layers[0]);
+  }
+  else glTexSubImage3D(GL_TEXTURE_2D_ARRAY, numLevels-1, 0, 0, 0, 1, 1, count, GL_BGRA, GL_UNSIGNED_BYTE, &layers[0]);
+  return tex;
+}
+
+//Size of a cooked texture's mip chain
+static size_t textureDataBytes(int format){
+  size_t bytes = 0;
+  for (int size = MATERIAL_SIZE; size >= 1; size /= 2) bytes += textureLevelBytes(format, size);
+  return bytes;
+}
+
+//Upload a staged texture into its layer of the array, from the bound PBO
+static void uploadMaterialLayer(int layer, int format){
+  size_t offset = 0;
+  for (int l = 0, size = MATERIAL_SIZE; size >= 1; l++, size /= 2){
+    size_t bytes = textureLevelBytes(format, size);
+    if (format == TEXTURE_BC1){
+      glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, layer, size, size, 1, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, bytes, (void*)offset);
+    }
+    else glTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, layer, size, size, 1, GL_BGRA, GL_UNSIGNED_BYTE, (void*)offset);
+    offset += bytes;
+  }
+}
+
+//// Asset Loading ///////
+
+static const char* assetName(const AssetJob& job){
+  return job.kind == ASSET_MODEL ? modelFiles[job.index] : materialFiles[job.index];
+}
+
+//Worker thread: load or stage whatever job is queued next
+static void assetWorker(AssetLoader* loader){
+  while (true){
+    int j;
+    {
+      unique_lock<mutex> guard(loader->lock);
+      while (!loader->quit && loader->queue.empty()) loader->wake.wait(guard);
+      if (loader->quit) return;
+      j = loader->queue.front();
+      loader->queue.pop_front();
+    }
+    AssetJob& job = loader->jobs[j];
+    AssetState next;
+    if (job.state == ASSET_LOADING){
+      bool ok;
+      if (job.kind == ASSET_MODEL) ok = loadMeshCache(modelFiles[job.index], job.mesh);
+      else ok = mapTextureCache(materialFiles[job.index], compressTextures ? TEXTURE_BC1 : TEXTURE_BGRA8, job.mapBase, job.mapLength);
+      next = ok ? ASSET_LOADED : ASSET_FAILED;
+    }
+    else { //ASSET_STAGING
+      if (job.kind == ASSET_MODEL){
+        size_t vertBytes = (size_t)job.mesh.header->numVerts*sizeof(PackedVertex);
+        memcpy(job.stagingPtr, job.mesh.verts, vertBytes);
+        memcpy((char*)job.stagingPtr + vertBytes, job.mesh.indices, job.mesh.header->numIndices*sizeof(unsigned int));
+        //Tell the shaders which MeshDecode entry is this model's
+        PackedVertex* staged = (PackedVertex*)job.stagingPtr;
+        for (int v = 0; v < job.mesh.header->numVerts; v++) staged[v].position[3] = job.index;
+      }
+      else memcpy(job.stagingPtr, (const char*)job.mapBase + sizeof(TextureCacheHeader), job.stagingBytes);
+      next = ASSET_STAGED;
+    }
+    lock_guard<mutex> guard(loader->lock);
+    job.state = next;
+  }
+}
+
+//Queue every model and texture and start the workers
+void startAssetLoading(AssetLoader& loader){
+  loader.jobs.clear();
+  for (int m = 0; m < NUM_MODELS; m++){
+    AssetJob job;
+    memset(&job, 0, sizeof(job));
+    job.kind = ASSET_MODEL;
+    job.index = m;
+    loader.jobs.push_back(job);
+  }
+  for (int t = 0; t < NUM_MATERIALS; t++){
+    AssetJob job;
+    memset(&job, 0, sizeof(job));
+    job.kind = ASSET_TEXTURE;
+    job.index = t;
+    loader.jobs.push_back(job);
+  }
+  loader.quit = false;
+  loader.numDone = loader.modelsStaged = 0;
+  for (size_t j = 0; j < loader.jobs.size(); j++){
+    loader.jobs[j].state = ASSET_LOADING;
+    loader.queue.push_back(j);
+  }
+  int numWorkers = max(1, min(SDL_GetCPUCount()-1, (int)loader.jobs.size()));
+  for (int w = 0; w < numWorkers; w++) loader.workers.push_back(thread(assetWorker, &loader));
+  printf("Loading %d assets on %d threads\n", (int)loader.jobs.size(), numWorkers);
+}
+
+//Every model is staged: lay them out one after another in the shared VBO/EBO, copy them over
+//on the GPU and point the model VAOs at the result
+static void uploadModels(AssetLoader& loader){
+  //SJG: Store the start and size of each model so drawGeometry can find it in the shared buffers
+  int totalNumVerts = 0, totalNumIndices = 0;
+  const MeshCacheHeader* layout = NULL;
+  for (size_t j = 0; j < loader.jobs.size(); j++){
+    if (loader.jobs[j].kind != ASSET_MODEL) continue;
+    int m = loader.jobs[j].index;
+    layout = loader.jobs[j].mesh.header;
+    modelRanges[m].baseVertex = totalNumVerts;
+    modelRanges[m].numVerts = layout->numVerts;
+    modelRanges[m].firstIndex = totalNumIndices;
+    modelRanges[m].numIndices = layout->lods[0].numIndices;
+    modelRanges[m].numLods = layout->numLods;
+    for (int l = 0; l < layout->numLods; l++){
+      modelRanges[m].lods[l] = layout->lods[l];
+      modelRanges[m].lods[l].firstIndex += totalNumIndices;
+    }
+    modelRanges[m].radius = layout->radius;
+    meshDecode.center[m] = glm::vec4(layout->center[0], layout->center[1], layout->center[2], 0);
+    meshDecode.halfExtent[m] = glm::vec4(layout->halfExtent[0], layout->halfExtent[1], layout->halfExtent[2], 0);
+    meshDecode.texcoord[m] = glm::vec4(layout->texcoordMin[0], layout->texcoordMin[1], layout->texcoordExtent[0], layout->texcoordExtent[1]);
+    totalNumVerts += modelRanges[m].numVerts;
+    totalNumIndices += layout->numIndices; //Every LOD
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, meshDecodeUbo);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MeshDecodeUniforms), &meshDecode);
+  size_t stride = sizeof(PackedVertex); //Every cache shares the same layout
+  glBindBuffer(GL_ARRAY_BUFFER, loader.modelVbo);
+  glBufferData(GL_ARRAY_BUFFER, totalNumVerts*stride, NULL, GL_STATIC_DRAW);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, loader.modelEbo);
+  glBufferData(GL_COPY_WRITE_BUFFER, totalNumIndices*sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+  for (size_t j = 0; j < loader.jobs.size(); j++){
+    AssetJob& job = loader.jobs[j];
+    if (job.kind != ASSET_MODEL) continue;
+    const MeshRange& range = modelRanges[job.index];
+    size_t vertBytes = range.numVerts*stride;
+    glBindBuffer(GL_COPY_READ_BUFFER, job.staging);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0, range.baseVertex*stride, vertBytes);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, vertBytes, range.firstIndex*sizeof(unsigned int),
+                        job.mesh.header->numIndices*sizeof(unsigned int));
+    glDeleteBuffers(1, &job.staging);
+  }
+  glBindVertexArray(loader.modelVao); //Already has the EBO bound
+  glBindBuffer(GL_ARRAY_BUFFER, loader.modelVbo);
+  setModelAttribs(*loader.modelShader, layout);
+  glBindVertexArray(0);
+  forgetGLState(glState);
+  //The geometry now lives on the GPU, so we can drop the file mappings
+  for (size_t j = 0; j < loader.jobs.size(); j++){
+    if (loader.jobs[j].kind == ASSET_MODEL) unmapMeshCache(loader.jobs[j].mesh);
+  }
+}
+
+//GL thread, once per frame: stage what the workers loaded and upload what they staged.
+//Returns false if an asset couldn't be loaded.
+bool pumpAssets(AssetLoader& loader){
+  if (loader.numDone == (int)loader.jobs.size()) return true;
+  vector<int> ready;
+  {
+    lock_guard<mutex> guard(loader.lock);
+    for (size_t j = 0; j < loader.jobs.size(); j++){
+      AssetState state = loader.jobs[j].state;
+      if (state == ASSET_LOADED || state == ASSET_STAGED || state == ASSET_FAILED) ready.push_back(j);
+    }
+  }
+  int format = compressTextures ? TEXTURE_BC1 : TEXTURE_BGRA8;
+  for (size_t r = 0; r < ready.size(); r++){ //The workers don't touch jobs in these states
+    AssetJob& job = loader.jobs[ready[r]];
+    GLenum target = job.kind == ASSET_MODEL ? GL_COPY_WRITE_BUFFER : GL_PIXEL_UNPACK_BUFFER;
+    if (job.state == ASSET_FAILED){
+      printf("ERROR: Failed to load %s\n", assetName(job));
+      return false;
+    }
+    if (job.state == ASSET_LOADED){ //Map a staging buffer for a worker to fill
+      if (job.kind == ASSET_MODEL){
+        job.stagingBytes = (size_t)job.mesh.header->numVerts*sizeof(PackedVertex) + (size_t)job.mesh.header->numIndices*4;
+      }
+      else job.stagingBytes = textureDataBytes(format);
+      glGenBuffers(1, &job.staging);
+      glBindBuffer(target, job.staging);
+      glBufferData(target, job.stagingBytes, NULL, GL_STREAM_COPY);
+      job.stagingPtr = glMapBufferRange(target, 0, job.stagingBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+      glBindBuffer(target, 0);
+      lock_guard<mutex> guard(loader.lock);
+      job.state = ASSET_STAGING;
+      loader.queue.push_back(ready[r]);
+      loader.wake.notify_one();
+      continue;
+    }
+    //ASSET_STAGED
+    glBindBuffer(target, job.staging);
+    glUnmapBuffer(target);
+    job.stagingPtr = NULL;
+    if (job.kind == ASSET_TEXTURE){
+      glActiveTexture(GL_TEXTURE0 + MATERIAL_UNIT);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, loader.materialTex);
+      uploadMaterialLayer(job.index, format); //From the PBO, the driver can copy in the background
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      glDeleteBuffers(1, &job.staging);
+      unmapFile(job.mapBase, job.mapLength);
+      job.mapBase = NULL;
+    }
+    else {
+      glBindBuffer(target, 0);
+      if (++loader.modelsStaged == NUM_MODELS) uploadModels(loader);
+    }
+    job.state = ASSET_DONE;
+    loader.numDone++;
+  }
+
+  if (loader.numDone == (int)loader.jobs.size()){ //Show the real textures from now on
+    glActiveTexture(GL_TEXTURE0 + MATERIAL_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, loader.materialTex);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+    printf("All assets loaded after %.1f ms\n", elapsedMs(loader.start));
+  }
+  return true;
+}
+
+void stopAssetLoading(AssetLoader& loader){
+  {
+    lock_guard<mutex> guard(loader.lock);
+    loader.quit = true;
+  }
+  loader.wake.notify_all();
+  for (size_t w = 0; w < loader.workers.size(); w++) loader.workers[w].join();
+  loader.workers.clear();
+}
+
 // Create a GLSL program object from vertex and fragment shader files
 GLuint InitShader(const char* vShaderFileName, const char* fShaderFileName){
 	GLuint vertex_shader, fragment_shader;
@@ -876,8 +5039,8 @@ GLuint InitShader(const char* vShaderFileName, const char* fShaderFileName){
 	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
 
 	// Read source code from shader files
-	vs_text = readShaderSource(vShaderFileName);
-	fs_text = readShaderSource(fShaderFileName);
+	vs_text = readShaderWithIncludes(vShaderFileName);
+	fs_text = readShaderWithIncludes(fShaderFileName);
 
 	// error check
 	if (vs_text == NULL) {
@@ -952,5 +5115,71 @@ GLuint InitShader(const char* vShaderFileName, const char* fShaderFileName){
 	// Link and set program to use
 	glLinkProgram(program);
 
+	//Check for Errors
+	GLint linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		printf("Shader program (%s, %s) failed to link\n", vShaderFileName, fShaderFileName);
+		if (DEBUG_ON) {
+			GLint logMaxSize, logLength;
+			glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logMaxSize);
+			char* logMsg = new char[logMaxSize];
+			glGetProgramInfoLog(program, logMaxSize, &logLength, logMsg);
+			printf("error message: %s\n", logMsg);
+			delete[] logMsg;
+		}
+		exit(1);
+	}
+
 	return program;
 }
+
+//Build a program with InitShader and record where all of its active uniforms and attributes
+//live. Also hooks up the Frame block and the materials sampler, which never change after linking.
+bool loadShaderProgram(ShaderProgram& shader, const char* vShaderFileName, const char* fShaderFileName){
+	shader.id = InitShader(vShaderFileName, fShaderFileName);
+	shader.uniforms.clear();
+	shader.attribs.clear();
+
+	GLint count, maxLength;
+	GLint size;
+	GLenum type;
+	glGetProgramiv(shader.id, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(shader.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	vector<char> name(maxLength+1);
+	for (int i = 0; i < count; i++){
+		glGetActiveUniform(shader.id, i, name.size(), NULL, &size, &type, &name[0]);
+		GLint location = glGetUniformLocation(shader.id, &name[0]);
+		if (location >= 0) shader.uniforms[&name[0]] = location; //Block members have no location
+	}
+	glGetProgramiv(shader.id, GL_ACTIVE_ATTRIBUTES, &count);
+	glGetProgramiv(shader.id, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+	name.resize(maxLength+1);
+	for (int i = 0; i < count; i++){
+		glGetActiveAttrib(shader.id, i, name.size(), NULL, &size, &type, &name[0]);
+		shader.attribs[&name[0]] = glGetAttribLocation(shader.id, &name[0]);
+	}
+
+	GLuint frameBlock = glGetUniformBlockIndex(shader.id, "Frame");
+	if (frameBlock != GL_INVALID_INDEX) glUniformBlockBinding(shader.id, frameBlock, FRAME_UBO_BINDING);
+	GLuint meshBlock = glGetUniformBlockIndex(shader.id, "MeshDecode");
+	if (meshBlock != GL_INVALID_INDEX) glUniformBlockBinding(shader.id, meshBlock, MESH_DECODE_UBO_BINDING);
+	glUseProgram(shader.id);
+	if (shader.uniform("materials") >= 0) glUniform1i(shader.uniform("materials"), MATERIAL_UNIT);
+	if (shader.uniform("lightData") >= 0) glUniform1i(shader.uniform("lightData"), LIGHT_DATA_UNIT);
+	if (shader.uniform("lightGrid") >= 0) glUniform1i(shader.uniform("lightGrid"), LIGHT_GRID_UNIT);
+	if (shader.uniform("lightIndices") >= 0) glUniform1i(shader.uniform("lightIndices"), LIGHT_INDEX_UNIT);
+	if (DEBUG_ON) printf("%s + %s: %d uniforms, %d attributes\n", vShaderFileName, fShaderFileName,
+	                     (int)shader.uniforms.size(), (int)shader.attribs.size());
+	return true;
+}
+
+GLint ShaderProgram::uniform(const char* name) const {
+	unordered_map<string,GLint>::const_iterator it = uniforms.find(name);
+	return it == uniforms.end() ? -1 : it->second;
+}
+
+GLint ShaderProgram::attrib(const char* name) const {
+	unordered_map<string,GLint>::const_iterator it = attribs.find(name);
+	return it == attribs.end() ? -1 : it->second;
+}
@@ -0,0 +1,9 @@
+#version 150 core
+
+in vec4 Color;
+
+out vec4 outColor;
+
+void main() {
+   outColor = Color;
+}
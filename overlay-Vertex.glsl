@@ -0,0 +1,12 @@
+#version 150 core
+
+//The profiler overlay: flat colored quads given straight in normalized device coordinates
+in vec2 position;
+in vec4 inColor;
+
+out vec4 Color;
+
+void main() {
+   Color = inColor;
+   gl_Position = vec4(position, 0.0, 1.0);
+}
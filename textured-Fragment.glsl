@@ -5,33 +5,24 @@ in vec3 vertNormal;
 in vec3 pos;
 in vec3 lightDir;
 in vec2 texcoord;
+flat in int fragTexID;
 
 out vec4 outColor;
 
-uniform sampler2D tex0;
-uniform sampler2D tex1;
-uniform sampler2D tex2;
-uniform sampler2D tex3;
+uniform sampler2DArray materials; //One layer per texture, see createMaterialArray
 
-uniform int texID;
+//Point lights, binned into clusters on the CPU (see binLights)
+uniform samplerBuffer lightData;     //Two texels per light: view space position and radius, color
+uniform usamplerBuffer lightGrid;    //Per cluster: first entry in lightIndices, count
+uniform usamplerBuffer lightIndices;
+
+#include "frame-Include.glsl"
 
 const float ambient = .3;
 void main() {
-  vec3 color;
-  if (texID == -1)
-    color = Color;
-  else if (texID == 0)
-    color = texture(tex0, texcoord).rgb;
-  else if (texID == 1)
-    color = texture(tex1, texcoord).rgb;
-  else if (texID == 2)
-    color = texture(tex2, texcoord).rgb;
-  else if (texID == 3)
-    color = texture(tex3, texcoord).rgb;
-  else{
-    outColor = vec4(1,0,0,1);
-    return; //This was an error, stop lighting!
-  }
+  //Sample first so every fragment takes the same path, then pick (-1 = no texture)
+  vec3 texColor = texture(materials, vec3(texcoord, float(fragTexID))).rgb;
+  vec3 color = fragTexID < 0 ? Color : texColor;
   vec3 normal = normalize(vertNormal);
   vec3 diffuseC = color*max(dot(-lightDir,normal),0.0);
   vec3 ambC = color*ambient;
@@ -41,5 +32,20 @@ void main() {
   if (dot(-lightDir,normal) <= 0.0) spec = 0; //No highlight if we are not facing the light
   vec3 specC = .8*vec3(1.0,1.0,1.0)*pow(spec,4);
   vec3 oColor = ambC+diffuseC+specC;
+
+  //Only the lights in this fragment's cluster can reach it
+  ivec2 tile = ivec2(gl_FragCoord.xy) / clusterGrid.w;
+  int slice = int(floor(log(-pos.z / clusterDepth.x) * clusterDepth.z));
+  if (slice >= 0 && slice < clusterGrid.z && tile.x < clusterGrid.x && tile.y < clusterGrid.y){
+    uvec2 range = texelFetch(lightGrid, (slice*clusterGrid.y + tile.y)*clusterGrid.x + tile.x).xy;
+    for (uint i = 0u; i < range.y; i++){
+      int light = int(texelFetch(lightIndices, int(range.x + i)).x);
+      vec4 lightPos = texelFetch(lightData, 2*light);
+      vec3 toLight = lightPos.xyz - pos;
+      float dist = length(toLight);
+      float falloff = clamp(1.0 - dist/lightPos.w, 0.0, 1.0);
+      oColor += color * texelFetch(lightData, 2*light+1).rgb * max(dot(normal, toLight/dist), 0.0) * falloff*falloff;
+    }
+  }
   outColor = vec4(oColor,1);
 }